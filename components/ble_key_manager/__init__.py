@@ -3,7 +3,7 @@
 import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import web_server_base
-from esphome.const import CONF_ID
+from esphome.const import CONF_ID, CONF_INTERVAL, CONF_PASSWORD, CONF_PORT, CONF_USERNAME
 
 AUTO_LOAD = ['web_server_base']
 DEPENDENCIES = ['web_server_base', 'esp32_ble_tracker']
@@ -14,17 +14,122 @@ BLEWebInterface = ble_key_manager_ns.class_('BLEWebInterface', cg.Component)
 
 CONF_BLE_DEVICE_MANAGER = 'ble_device_manager'
 CONF_WEB_INTERFACE = 'web_interface'
+CONF_WEB_INTERFACE_ID = 'web_interface_id'
+CONF_SESSION_TTL = 'session_ttl'
+CONF_RSSI_HISTORY_SIZE = 'rssi_history_size'
+CONF_ACTIVE_WINDOW = 'active_window'
+CONF_STORAGE_PARTITION = 'storage_partition'
+CONF_DEDUP_WINDOW = 'dedup_window'
+CONF_CARD_CACHE_SIZE = 'card_cache_size'
+CONF_ALLOC_TRACKING = 'alloc_tracking'
+CONF_FUSION = 'fusion'
+CONF_NODE_ID = 'node_id'
+CONF_PEERS = 'peers'
+CONF_WINDOW = 'window'
+CONF_RATE_LIMIT = 'rate_limit'
+CONF_CLIENT_RATE = 'client_rate'
+CONF_CLIENT_BURST = 'client_burst'
+CONF_GLOBAL_RATE = 'global_rate'
+CONF_GLOBAL_BURST = 'global_burst'
+CONF_MAX_IN_FLIGHT = 'max_in_flight'
+
+# Limiti di frequenza dell'interfaccia web (gettoni al secondo e capienza;
+# una lettura costa 1 gettone, una modifica 4, import/export e batch 8)
+RATE_LIMIT_SCHEMA = cv.Schema({
+    cv.Optional(CONF_CLIENT_RATE, default=2): cv.int_range(min=1, max=1000),
+    cv.Optional(CONF_CLIENT_BURST, default=10): cv.int_range(min=8, max=1000),
+    cv.Optional(CONF_GLOBAL_RATE, default=8): cv.int_range(min=1, max=1000),
+    cv.Optional(CONF_GLOBAL_BURST, default=30): cv.int_range(min=8, max=1000),
+    cv.Optional(CONF_MAX_IN_FLIGHT, default=4): cv.int_range(min=1, max=16),
+})
+
+# Nodo della fusione: "indirizzo IPv4" o "indirizzo IPv4:porta" (senza porta
+# vale quella del nodo locale)
+def fusion_peer(value):
+    value = cv.string_strict(value)
+    host, sep, port = value.partition(':')
+    cv.ipv4address(host)
+    if sep:
+        cv.port(cv.int_(port))
+    return value
+
+# Scambio delle rilevazioni con altri nodi via UDP per stimare quale nodo
+# è più vicino a ogni dispositivo. Vengono accettati solo i pacchetti
+# inviati dai nodi in peers (al massimo 8).
+FUSION_SCHEMA = cv.Schema({
+    cv.Required(CONF_NODE_ID): cv.int_range(min=0, max=65535),
+    cv.Optional(CONF_PORT, default=45678): cv.port,
+    cv.Optional(CONF_PEERS, default=[]): cv.All(cv.ensure_list(fusion_peer), cv.Length(max=8)),
+    cv.Optional(CONF_INTERVAL, default='200ms'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_WINDOW, default='5s'): cv.positive_time_period_milliseconds,
+})
 
 CONFIG_SCHEMA = cv.Schema({
     cv.GenerateID(CONF_BLE_DEVICE_MANAGER): cv.declare_id(BLEDeviceManager),
+    cv.GenerateID(CONF_WEB_INTERFACE_ID): cv.declare_id(BLEWebInterface),
     cv.Optional(CONF_WEB_INTERFACE): cv.use_id(web_server_base.WebServerBase),
+    # Credenziali dell'interfaccia web (obbligatorie con web_interface) e durata delle sessioni
+    cv.Optional(CONF_USERNAME): cv.All(cv.string_strict, cv.Length(min=1)),
+    cv.Optional(CONF_PASSWORD): cv.All(cv.string_strict, cv.Length(min=1)),
+    cv.Optional(CONF_SESSION_TTL, default='15min'): cv.positive_time_period_seconds,
+    cv.Optional(CONF_RATE_LIMIT, default={}): RATE_LIMIT_SCHEMA,
+    # Byte di RAM per le schede dispositivo già generate della pagina principale (0 = nessuna cache)
+    cv.Optional(CONF_CARD_CACHE_SIZE, default=16384): cv.int_range(min=0, max=65536),
+    # Byte di storico RSSI per dispositivo (metà campioni recenti, metà medie per minuto)
+    cv.Optional(CONF_RSSI_HISTORY_SIZE, default=256): cv.int_range(min=32, max=4096),
+    # Un dispositivo è attivo se rilevato entro questo intervallo
+    cv.Optional(CONF_ACTIVE_WINDOW, default='5min'): cv.positive_time_period_seconds,
+    # Le rilevazioni ripetute dello stesso MAC entro questo intervallo vengono ignorate
+    cv.Optional(CONF_DEDUP_WINDOW, default='1s'): cv.positive_time_period_milliseconds,
+    cv.Optional(CONF_FUSION): FUSION_SCHEMA,
+    # Partizione dati della flash che contiene il giornale del registro
+    cv.Optional(CONF_STORAGE_PARTITION, default='blekm'): cv.All(cv.string_strict, cv.Length(min=1, max=16)),
+    # Conta allocazioni e byte per punto del componente (sostituisce new/delete globali)
+    cv.Optional(CONF_ALLOC_TRACKING, default=False): cv.boolean,
 })
 
+# Le credenziali non hanno valori predefiniti: un'interfaccia web con una
+# password nota a tutti darebbe accesso al registro a chiunque sulla rete
+def validate_credentials(config):
+    if CONF_WEB_INTERFACE not in config:
+        return config
+    for key in (CONF_USERNAME, CONF_PASSWORD):
+        if key not in config:
+            raise cv.Invalid(f"'{key}' è obbligatorio con '{CONF_WEB_INTERFACE}'", path=[key])
+    if config[CONF_PASSWORD] == 'password':
+        raise cv.Invalid("Scegliere una password diversa da 'password'", path=[CONF_PASSWORD])
+    return config
+
+CONFIG_SCHEMA = cv.All(CONFIG_SCHEMA, validate_credentials)
+
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_BLE_DEVICE_MANAGER])
     await cg.register_component(var, config)
+    cg.add_define("BLE_KEY_MANAGER_RSSI_HISTORY_SIZE", config[CONF_RSSI_HISTORY_SIZE])
+    if config[CONF_ALLOC_TRACKING]:
+        cg.add_define("BLE_KEY_MANAGER_ALLOC_TRACKING")
+    cg.add(var.set_active_window(config[CONF_ACTIVE_WINDOW].total_seconds))
+    cg.add(var.set_dedup_window(config[CONF_DEDUP_WINDOW].total_milliseconds))
+    cg.add(var.set_storage_partition(config[CONF_STORAGE_PARTITION]))
+    
+    if CONF_FUSION in config:
+        fusion = config[CONF_FUSION]
+        cg.add(var.set_fusion_node_id(fusion[CONF_NODE_ID]))
+        cg.add(var.set_fusion_port(fusion[CONF_PORT]))
+        for peer in fusion[CONF_PEERS]:
+            cg.add(var.add_fusion_peer(peer))
+        cg.add(var.set_fusion_interval(fusion[CONF_INTERVAL].total_milliseconds))
+        cg.add(var.set_fusion_window(fusion[CONF_WINDOW].total_milliseconds))
     
     if CONF_WEB_INTERFACE in config:
         web_server = await cg.get_variable(config[CONF_WEB_INTERFACE])
-        web_interface = cg.new_Pvariable(BLEWebInterface, var)
+        web_interface = cg.new_Pvariable(config[CONF_WEB_INTERFACE_ID], var)
         await cg.register_component(web_interface, config)
+        cg.add(web_interface.set_credentials(config[CONF_USERNAME], config[CONF_PASSWORD]))
+        cg.add(web_interface.set_session_ttl(config[CONF_SESSION_TTL].total_seconds))
+        
+        rate_limit = config[CONF_RATE_LIMIT]
+        cg.add(web_interface.set_rate_limits(rate_limit[CONF_CLIENT_RATE], rate_limit[CONF_CLIENT_BURST],
+                                             rate_limit[CONF_GLOBAL_RATE], rate_limit[CONF_GLOBAL_BURST],
+                                             rate_limit[CONF_MAX_IN_FLIGHT]))
+        cg.add(web_interface.set_card_cache_size(config[CONF_CARD_CACHE_SIZE]))
@@ -0,0 +1,155 @@
+#if __has_include("esphome/core/defines.h")
+#include "esphome/core/defines.h"
+#endif
+#include "alloc_tracker.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef USE_ESP32
+#include <esp_heap_caps.h>
+#endif
+
+namespace esphome {
+
+namespace {
+
+struct SiteCounters {
+  std::atomic<uint32_t> allocations{0};
+  std::atomic<uint32_t> bytes{0};
+  std::atomic<uint32_t> current_bytes{0};
+  std::atomic<uint32_t> peak_bytes{0};
+};
+
+// Contatori a inizializzazione costante: validi anche per le allocazioni
+// fatte dai costruttori statici prima di main
+SiteCounters site_counters[ALLOC_SITE_COUNT];
+std::atomic<uint32_t> total_allocations{0};
+std::atomic<uint32_t> total_current_bytes{0};
+std::atomic<uint32_t> total_peak_bytes{0};
+thread_local AllocSite current_site = ALLOC_SITE_OTHER;
+
+void raise_peak(std::atomic<uint32_t> &peak, uint32_t value) {
+  uint32_t seen = peak.load(std::memory_order_relaxed);
+  while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+  }
+}
+
+} // namespace
+
+#ifdef BLE_KEY_MANAGER_ALLOC_TRACKING
+bool AllocTracker::is_enabled() { return true; }
+#else
+bool AllocTracker::is_enabled() { return false; }
+#endif
+
+AllocSite AllocTracker::enter(AllocSite site) {
+  AllocSite previous = current_site;
+  current_site = site;
+  return previous;
+}
+
+AllocSite AllocTracker::get_current_site() { return current_site; }
+
+void AllocTracker::record_alloc(AllocSite site, size_t size) {
+  SiteCounters &counters = site_counters[site];
+  counters.allocations.fetch_add(1, std::memory_order_relaxed);
+  counters.bytes.fetch_add(size, std::memory_order_relaxed);
+  raise_peak(counters.peak_bytes, counters.current_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+  total_allocations.fetch_add(1, std::memory_order_relaxed);
+  raise_peak(total_peak_bytes, total_current_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+}
+
+void AllocTracker::record_free(AllocSite site, size_t size) {
+  site_counters[site].current_bytes.fetch_sub(size, std::memory_order_relaxed);
+  total_current_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+AllocSiteStats AllocTracker::get_site_stats(AllocSite site) {
+  AllocSiteStats stats;
+  if (site >= ALLOC_SITE_COUNT) {
+    return stats;
+  }
+  const SiteCounters &counters = site_counters[site];
+  stats.allocations = counters.allocations.load(std::memory_order_relaxed);
+  stats.bytes = counters.bytes.load(std::memory_order_relaxed);
+  stats.current_bytes = counters.current_bytes.load(std::memory_order_relaxed);
+  stats.peak_bytes = counters.peak_bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+uint32_t AllocTracker::get_allocations() { return total_allocations.load(std::memory_order_relaxed); }
+uint32_t AllocTracker::get_current_bytes() { return total_current_bytes.load(std::memory_order_relaxed); }
+uint32_t AllocTracker::get_peak_bytes() { return total_peak_bytes.load(std::memory_order_relaxed); }
+
+#ifdef USE_ESP32
+uint32_t AllocTracker::get_free_heap() { return heap_caps_get_free_size(MALLOC_CAP_8BIT); }
+uint32_t AllocTracker::get_largest_free_block() { return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT); }
+uint32_t AllocTracker::get_min_free_heap() { return heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT); }
+#else
+uint32_t AllocTracker::get_free_heap() { return 0; }
+uint32_t AllocTracker::get_largest_free_block() { return 0; }
+uint32_t AllocTracker::get_min_free_heap() { return 0; }
+#endif
+
+} // namespace esphome
+
+#ifdef BLE_KEY_MANAGER_ALLOC_TRACKING
+
+// Sostituzione degli operatori globali. Ogni blocco è preceduto da
+// un'intestazione con la dimensione richiesta e il punto che l'ha allocato,
+// così il rilascio viene attribuito allo stesso punto. Le varianti con
+// allineamento esplicito non sono sostituite e restano fuori dal conteggio.
+namespace {
+
+struct alignas(alignof(std::max_align_t)) AllocHeader {
+  uint32_t size;
+  esphome::AllocSite site;
+};
+
+void *tracked_alloc(size_t size) {
+  AllocHeader *header = static_cast<AllocHeader *>(std::malloc(sizeof(AllocHeader) + size));
+  if (header == nullptr) {
+    return nullptr;
+  }
+  header->size = size;
+  header->site = esphome::AllocTracker::get_current_site();
+  esphome::AllocTracker::record_alloc(header->site, size);
+  return header + 1;
+}
+
+void tracked_free(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  AllocHeader *header = static_cast<AllocHeader *>(ptr) - 1;
+  esphome::AllocTracker::record_free(header->site, header->size);
+  std::free(header);
+}
+
+void *tracked_alloc_or_fail(size_t size) {
+  void *ptr = tracked_alloc(size);
+  if (ptr == nullptr) {
+#ifdef __cpp_exceptions
+    throw std::bad_alloc();
+#else
+    std::abort();
+#endif
+  }
+  return ptr;
+}
+
+} // namespace
+
+void *operator new(size_t size) { return tracked_alloc_or_fail(size); }
+void *operator new[](size_t size) { return tracked_alloc_or_fail(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return tracked_alloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return tracked_alloc(size); }
+void operator delete(void *ptr) noexcept { tracked_free(ptr); }
+void operator delete[](void *ptr) noexcept { tracked_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { tracked_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { tracked_free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { tracked_free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { tracked_free(ptr); }
+
+#endif // BLE_KEY_MANAGER_ALLOC_TRACKING
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+
+// Punti del componente a cui vengono attribuite le allocazioni. Ogni
+// allocazione fatta mentre è attivo un AllocScope viene contata sul suo
+// punto; le altre (librerie, altri componenti) su ALLOC_SITE_OTHER.
+enum AllocSite : uint8_t {
+  ALLOC_SITE_OTHER,
+  ALLOC_SITE_INGEST,          // Rilevazioni applicate al registro
+  ALLOC_SITE_FUSION,          // Pacchetti scambiati con gli altri nodi
+  ALLOC_SITE_STORAGE,         // Caricamento e compattazione del giornale
+  ALLOC_SITE_EXPIRY,          // Controllo delle autorizzazioni scadute
+  ALLOC_SITE_SENSORS,         // Pubblicazione dei contatori
+  ALLOC_SITE_BUTTON,          // Scelta del dispositivo più vicino (pulsante)
+  ALLOC_SITE_HTTP_LOGIN,
+  ALLOC_SITE_HTTP_LOGOUT,
+  ALLOC_SITE_HTTP_PAGE,
+  ALLOC_SITE_HTTP_ADD,
+  ALLOC_SITE_HTTP_AUTHORIZE,  // /authorize e /authorize_temp
+  ALLOC_SITE_HTTP_REVOKE,
+  ALLOC_SITE_HTTP_DELETE,
+  ALLOC_SITE_HTTP_HISTORY,
+  ALLOC_SITE_HTTP_DEVICES,
+  ALLOC_SITE_HTTP_METRICS,
+  ALLOC_SITE_HTTP_EXPORT,
+  ALLOC_SITE_HTTP_IMPORT,
+  ALLOC_SITE_HTTP_BATCH,
+  ALLOC_SITE_COUNT,
+};
+
+inline const char *alloc_site_name(AllocSite site) {
+  static const char *const NAMES[ALLOC_SITE_COUNT] = {
+      "other",        "ingest",         "fusion",       "storage",      "expiry",
+      "sensors",      "button",         "http_login",   "http_logout",  "http_page",
+      "http_add",     "http_authorize", "http_revoke",  "http_delete",  "http_history",
+      "http_devices", "http_metrics",   "http_export",  "http_import",  "http_batch",
+  };
+  return site < ALLOC_SITE_COUNT ? NAMES[site] : "unknown";
+}
+
+// Contatori di un punto di allocazione
+struct AllocSiteStats {
+  uint32_t allocations = 0;    // Allocazioni totali
+  uint32_t bytes = 0;          // Byte allocati in totale
+  uint32_t current_bytes = 0;  // Byte ancora allocati
+  uint32_t peak_bytes = 0;     // Massimo di current_bytes
+};
+
+// Contabilità delle allocazioni fatte con new/delete. Il conteggio è attivo
+// solo se il firmware è compilato con BLE_KEY_MANAGER_ALLOC_TRACKING
+// (opzione alloc_tracking), che sostituisce gli operatori globali in
+// alloc_tracker.cpp; altrimenti i contatori restano a zero. Le stesse
+// funzioni valgono nei programmi di prova su PC, dove si può verificare che
+// un percorso non allochi confrontando get_allocations() prima e dopo.
+class AllocTracker {
+ public:
+  static bool is_enabled();
+
+  // Imposta il punto corrente del thread e restituisce il precedente
+  static AllocSite enter(AllocSite site);
+  static AllocSite get_current_site();
+
+  // Chiamate dagli operatori sostituiti
+  static void record_alloc(AllocSite site, size_t size);
+  static void record_free(AllocSite site, size_t size);
+
+  static AllocSiteStats get_site_stats(AllocSite site);
+  static uint32_t get_allocations();
+  static uint32_t get_current_bytes();
+  static uint32_t get_peak_bytes();
+
+  // Stato dello heap del sistema (0 se non disponibile, ad esempio su PC)
+  static uint32_t get_free_heap();
+  static uint32_t get_largest_free_block();
+  static uint32_t get_min_free_heap();
+};
+
+// Attribuisce al punto indicato le allocazioni fino alla fine del blocco
+class AllocScope {
+ public:
+  explicit AllocScope(AllocSite site) : previous_(AllocTracker::enter(site)) {}
+  ~AllocScope() { AllocTracker::enter(previous_); }
+  AllocScope(const AllocScope &) = delete;
+  AllocScope &operator=(const AllocScope &) = delete;
+
+ private:
+  AllocSite previous_;
+};
+
+#ifdef BLE_KEY_MANAGER_ALLOC_TRACKING
+#define BLE_KEY_MANAGER_ALLOC_SCOPE(site) ::esphome::AllocScope alloc_scope_(site)
+#else
+#define BLE_KEY_MANAGER_ALLOC_SCOPE(site)
+#endif
+
+} // namespace esphome
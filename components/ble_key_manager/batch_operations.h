@@ -0,0 +1,189 @@
+#pragma once
+
+#include "registry_codec.h"
+#include "rolling_code.h"
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace esphome {
+
+// Operazione di un gruppo di modifiche da applicare in modo atomico
+struct BatchOperation {
+  enum Type { ADD, SET_ACTION, AUTHORIZE, REVOKE, REMOVE, SET_KEY };
+
+  Type type = ADD;
+  std::string mac_address; // Già normalizzato in XX:XX:XX:XX:XX:XX
+  std::string name;
+  std::string action_id;
+  uint32_t duration = 0;   // Per AUTHORIZE: 0 = permanente, al massimo REGISTRY_MAX_DURATION
+  std::string key;         // Per SET_KEY: chiave del codice variabile (vuota = nessuna)
+
+  // Errore di analisi della riga (nullptr se valida)
+  const char *error = nullptr;
+};
+
+// Lettore incrementale di un gruppo di operazioni, una per riga in CSV:
+//   add,<mac>,<nome>[,<azione>]
+//   action,<mac>,<azione>
+//   authorize,<mac>[,<durata in secondi>]
+//   revoke,<mac>
+//   remove,<mac>
+//   key,<mac>[,<chiave in esadecimale, 32 cifre>]
+// Le righe non valide producono un'operazione con error impostato, così i
+// risultati restano allineati alle righe ricevute.
+class BatchReader {
+ public:
+  static const size_t MAX_OPERATIONS = 64;
+  static const size_t MAX_LINE_LENGTH = 256;
+
+  void feed(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      char c = static_cast<char>(data[i]);
+      if (c == '\n') {
+        end_line_();
+      } else if (c != '\r') {
+        if (line_.size() < MAX_LINE_LENGTH) {
+          line_.push_back(c);
+        } else {
+          overflow_ = true;
+        }
+      }
+    }
+  }
+
+  void finish() {
+    if (!line_.empty() || overflow_) {
+      end_line_();
+    }
+  }
+
+  const std::vector<BatchOperation> &operations() const { return operations_; }
+  bool too_many() const { return too_many_; }
+
+ private:
+  std::string line_;
+  std::vector<std::string> fields_;
+  std::vector<BatchOperation> operations_;
+  bool overflow_ = false;
+  bool too_many_ = false;
+
+  void end_line_() {
+    if (!line_.empty() || overflow_) {
+      if (operations_.size() >= MAX_OPERATIONS) {
+        too_many_ = true;
+      } else {
+        operations_.emplace_back();
+        BatchOperation &op = operations_.back();
+        if (overflow_) {
+          op.error = "Riga troppo lunga";
+        } else {
+          parse_line_(&op);
+        }
+      }
+    }
+    line_.clear();
+    overflow_ = false;
+  }
+
+  void parse_line_(BatchOperation *op) {
+    if (!split_csv_line(line_, &fields_) || fields_.size() < 2) {
+      op->error = "Riga non valida";
+      return;
+    }
+
+    const std::string &verb = fields_[0];
+    size_t expected_min, expected_max;
+    if (verb == "add") {
+      op->type = BatchOperation::ADD;
+      expected_min = 3;
+      expected_max = 4;
+    } else if (verb == "action") {
+      op->type = BatchOperation::SET_ACTION;
+      expected_min = 3;
+      expected_max = 3;
+    } else if (verb == "authorize") {
+      op->type = BatchOperation::AUTHORIZE;
+      expected_min = 2;
+      expected_max = 3;
+    } else if (verb == "revoke") {
+      op->type = BatchOperation::REVOKE;
+      expected_min = expected_max = 2;
+    } else if (verb == "remove") {
+      op->type = BatchOperation::REMOVE;
+      expected_min = expected_max = 2;
+    } else if (verb == "key") {
+      op->type = BatchOperation::SET_KEY;
+      expected_min = 2;
+      expected_max = 3;
+    } else {
+      op->error = "Operazione sconosciuta";
+      return;
+    }
+    if (fields_.size() < expected_min || fields_.size() > expected_max) {
+      op->error = "Numero di campi non valido";
+      return;
+    }
+
+    op->mac_address = normalize_mac(fields_[1]);
+    if (op->mac_address.empty()) {
+      op->error = "MAC non valido";
+      return;
+    }
+
+    switch (op->type) {
+      case BatchOperation::ADD:
+        op->name = fields_[2];
+        if (fields_.size() > 3) {
+          op->action_id = fields_[3];
+        }
+        if (op->name.empty() || op->name.size() > REGISTRY_MAX_NAME_LENGTH) {
+          op->error = "Nome non valido";
+        } else if (op->action_id.size() > REGISTRY_MAX_ACTION_LENGTH) {
+          op->error = "Azione troppo lunga";
+        }
+        break;
+      case BatchOperation::SET_ACTION:
+        op->action_id = fields_[2];
+        if (op->action_id.size() > REGISTRY_MAX_ACTION_LENGTH) {
+          op->error = "Azione troppo lunga";
+        }
+        break;
+      case BatchOperation::AUTHORIZE:
+        if (fields_.size() > 2 && !fields_[2].empty() &&
+            (!parse_uint32(fields_[2], &op->duration) || op->duration > REGISTRY_MAX_DURATION)) {
+          op->error = "Durata non valida";
+        }
+        break;
+      case BatchOperation::SET_KEY:
+        if (fields_.size() > 2 && !fields_[2].empty() && !parse_key_(fields_[2], &op->key)) {
+          op->error = "Chiave non valida";
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Converte una chiave esadecimale di ROLLING_KEY_SIZE byte
+  static bool parse_key_(const std::string &hex, std::string *key) {
+    if (hex.size() != 2 * ROLLING_KEY_SIZE) {
+      return false;
+    }
+    key->clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+      char digits[3] = {hex[i], hex[i + 1], '\0'};
+      char *end = nullptr;
+      long value = strtol(digits, &end, 16);
+      if (*end != '\0' || !isxdigit(static_cast<unsigned char>(digits[0]))) {
+        return false;
+      }
+      key->push_back(static_cast<char>(value));
+    }
+    return true;
+  }
+};
+
+} // namespace esphome
@@ -1,11 +1,26 @@
 #pragma once
 
 #include "esphome.h"
+#include "alloc_tracker.h"
+#include "batch_operations.h"
+#include "ble_ingest.h"
+#include "esp32_partition_flash.h"
+#include "fusion_link.h"
+#include "journal_store.h"
+#include "registry_codec.h"
+#include "rssi_history.h"
+#include "sighting_fusion.h"
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 
 namespace esphome {
 
+static const char *const BLE_KEY_MANAGER_TAG = "ble_key_manager";
+
 class BLEDeviceManager : public Component {
  public:
   struct BLEDevice {
@@ -15,160 +30,1325 @@ class BLEDeviceManager : public Component {
     int32_t last_rssi = 0;
     uint32_t last_seen = 0;
     uint32_t expiry_time = 0; // 0 = permanente, altrimenti timestamp di scadenza
+    uint32_t revision = 0;    // Revisione del registro all'ultima modifica del record
+    bool counted_authorized = false; // Stato già conteggiato nei contatori aggregati
+    bool counted_active = false;
+    std::string rolling_key;         // Chiave del codice variabile (vuota = basta il MAC)
+    uint32_t rolling_counter = 0;    // Ultimo contatore accettato
+    uint32_t rolling_saved = 0;      // Contatore scritto nel giornale
+    RollingToken last_token;         // Ultimo token nuovo con firma valida
+    uint32_t token_seen = 0;         // Prima ricezione di last_token (0 = nessun token utilizzabile)
+    uint32_t rolling_tracked = 0;    // Ultimo controllo della firma di un token ricevuto
+    bool rolling_synced = false;     // Contatore già seguito dopo l'avvio o il cambio di chiave
   };
 
+  // Dispositivo eliminato, conservato per la sincronizzazione incrementale
+  struct DeletedDevice {
+    std::string mac_address;
+    uint32_t revision = 0;
+  };
+
+  // Numero massimo di eliminazioni ricordate per la sincronizzazione
+  static const size_t MAX_DELETED_DEVICES = 32;
+
+  // Dispositivi scritti nello snapshot ad ogni ciclo durante la compattazione
+  static const size_t SNAPSHOT_DEVICES_PER_LOOP = 4;
+
+  // Capienza della coda delle rilevazioni e rilevazioni applicate per ciclo
+  static const size_t INGEST_RING_SIZE = 128;
+  static const size_t INGEST_BATCH_SIZE = 32;
+
+  // Pacchetti dagli altri nodi letti per ciclo
+  static const size_t FUSION_PACKETS_PER_LOOP = 4;
+  static constexpr uint32_t FUSION_NODE_UNKNOWN = UINT32_MAX;
+
+  // Secondi minimi tra due controlli della firma di un token nuovo ricevuto
+  // da un dispositivo (un HMAC ciascuno); i token nuovi arrivati nel
+  // frattempo vengono ignorati
+  static const uint32_t ROLLING_TRACK_INTERVAL = 1;
+
+  // Intervallo tra due salvataggi periodici (secondi): orologio del giornale,
+  // mentre ci sono autorizzazioni temporanee, e contatori dei token seguiti
+  // alla ricezione. È anche il tempo massimo che un'interruzione di corrente
+  // può aggiungere a un'autorizzazione.
+  static const uint32_t CLOCK_CHECKPOINT_INTERVAL = 60;
+
+  // Settori lasciati liberi oltre a due snapshot: lo snapshot nuovo viene
+  // scritto mentre il precedente è ancora necessario, e intanto le modifiche
+  // continuano ad essere aggiunte al giornale
+  static const size_t JOURNAL_SPARE_SECTORS = 2;
+
   BLEDeviceManager() {}
 
+  // Il registro è usato dal ciclo principale e dai gestori HTTP, che girano
+  // nel task async_tcp. I metodi pubblici lo bloccano da soli; chi usa i
+  // puntatori restituiti (get_device, get_device_at, get_rssi_history...)
+  // deve tenere questo mutex finché li usa.
+  std::recursive_mutex& get_mutex() const { return mutex_; }
+
   void setup() override {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    // Identificativo dell'avvio: le revisioni ripartono da zero ad ogni riavvio
+    epoch_ = random_uint32();
+    
     // Carica i dispositivi salvati
     load_devices();
+    
+    // Scambio delle rilevazioni con gli altri nodi
+    if (fusion_port_ != 0) {
+      fusion_link_.reset(new FusionLink());
+      if (!fusion_link_->open(fusion_port_)) {
+        ESP_LOGW(BLE_KEY_MANAGER_TAG, "Impossibile aprire la porta UDP %u", fusion_port_);
+        fusion_link_.reset();
+      } else {
+        for (const auto& peer : fusion_peers_) {
+          if (!fusion_link_->add_peer(peer)) {
+            ESP_LOGW(BLE_KEY_MANAGER_TAG, "Indirizzo del nodo non valido: %s", peer.c_str());
+          }
+        }
+        fusion_peer_nodes_.assign(fusion_link_->get_peer_count(), FUSION_NODE_UNKNOWN);
+      }
+    }
+    
+    // Conteggio iniziale, poi mantenuto ad ogni modifica
+    uint32_t current_time = millis() / 1000;
+    for (auto& device : devices_) {
+      update_counts_(device, current_time);
+    }
   }
 
   void loop() override {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    // Applica le rilevazioni accodate dallo scanner e quelle degli altri nodi
+    drain_ingest_();
+    fusion_step_();
+    
     // Controlla le autorizzazioni scadute
     check_expired_authorizations();
+    
+    // Compattazione del giornale, pochi dispositivi per ciclo
+    compact_step_();
+    checkpoint_();
+    
+#ifdef USE_SENSOR
+    publish_counts_();
+#endif
+  }
+
+  // Nome della partizione dati che contiene il giornale del registro
+  void set_storage_partition(const std::string& name) {
+    storage_partition_ = name;
   }
 
+  // Memoria del giornale alternativa alla partizione (da impostare prima di setup)
+  void set_flash_device(FlashDevice* flash) {
+    flash_ = flash;
+  }
+
+  // Giornale del registro (nullptr se la persistenza non è disponibile)
+  const JournalStore* get_journal() const {
+    return journal_.get();
+  }
+
+  // Intervallo entro cui le rilevazioni ripetute dello stesso MAC vengono ignorate (ms)
+  void set_dedup_window(uint32_t window_ms) {
+    deduplicator_.set_window(window_ms);
+  }
+
+  // Fusione delle rilevazioni di più nodi: identificativo di questo nodo,
+  // porta UDP (0 = disattivata), nodi a cui inviare le proprie rilevazioni,
+  // intervallo di invio e durata di validità delle letture (ms)
+  void set_fusion_node_id(uint32_t node_id) {
+    fusion_node_id_ = node_id;
+  }
+  void set_fusion_port(uint16_t port) {
+    fusion_port_ = port;
+  }
+  void add_fusion_peer(const std::string& peer) {
+    fusion_peers_.push_back(peer);
+  }
+  void set_fusion_interval(uint32_t interval_ms) {
+    fusion_interval_ = interval_ms;
+  }
+  void set_fusion_window(uint32_t window_ms) {
+    fusion_.set_window(window_ms);
+  }
+
+  // Secondi dall'ultima rilevazione entro cui un dispositivo è considerato attivo
+  void set_active_window(uint32_t seconds) {
+    active_window_ = seconds;
+  }
+
+#ifdef USE_SENSOR
+  // Sensori dei contatori aggregati (piattaforma sensor di ble_key_manager)
+  void set_authorized_sensor(sensor::Sensor *sensor) { authorized_sensor_ = sensor; }
+  void set_active_sensor(sensor::Sensor *sensor) { active_sensor_ = sensor; }
+  void set_expired_sensor(sensor::Sensor *sensor) { expired_sensor_ = sensor; }
+
+  // Intervallo minimo tra due pubblicazioni dei sensori (ms)
+  void set_min_publish_interval(uint32_t interval_ms) { min_publish_interval_ = interval_ms; }
+#endif
+
+  // Contatori aggregati, aggiornati ad ogni modifica, rilevazione e scadenza
+  uint32_t get_authorized_count() const { return authorized_count_; }
+  uint32_t get_active_count() const { return active_count_; }
+  // Dispositivi con autorizzazione scaduta o revocata
+  uint32_t get_expired_count() const { return devices_.size() - authorized_count_; }
+
   // Aggiunge un nuovo dispositivo
   bool add_device(const std::string& mac_address, const std::string& name, const std::string& action_id = "") {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    // Il MAC viene salvato sempre nel formato XX:XX:XX:XX:XX:XX
+    std::string mac = normalize_mac(mac_address);
+    if (mac.empty() || name.empty() || name.size() > REGISTRY_MAX_NAME_LENGTH ||
+        action_id.size() > REGISTRY_MAX_ACTION_LENGTH) {
+      return false;
+    }
+    
     // Verifica se il dispositivo esiste già
     for (auto& device : devices_) {
-      if (device.mac_address == mac_address) {
+      if (device.mac_address == mac) {
         // Aggiorna il nome e l'azione se il dispositivo esiste già
+        size_t action_len = action_id.empty() ? device.action_id.size() : action_id.size();
+        size_t growth = snapshot_growth_(device, name.size(), action_len, device.rolling_key.size());
+        if (growth > 0 && !journal_has_room_(growth)) {
+          return false;
+        }
         device.name = name;
         if (!action_id.empty()) {
           device.action_id = action_id;
         }
-        save_devices();
+        touch_(device);
+        journal_put_(device);
         return true;
       }
     }
 
     // Aggiungi nuovo dispositivo
+    if (devices_.size() >= REGISTRY_MAX_DEVICES ||
+        !journal_has_room_(snapshot_record_size_(name.size(), action_id.size(), 0))) {
+      return false;
+    }
     BLEDevice device;
-    device.mac_address = mac_address;
+    device.mac_address = mac;
     device.name = name;
     device.action_id = action_id;
     device.last_seen = 0;
     device.last_rssi = 0;
     device.expiry_time = 0;
+    touch_(device);
 
+    forget_deletion_(mac);
     devices_.push_back(device);
-    save_devices();
+    journal_put_(device);
     return true;
   }
 
-  // Rimuove un dispositivo
+  // Rimuove un dispositivo.
+  // Come le altre funzioni che ricevono un MAC, accetta qualsiasi formato
+  // valido per parse_mac (con '-' o ':', maiuscolo o minuscolo).
   bool remove_device(const std::string& mac_address) {
-    for (auto it = devices_.begin(); it != devices_.end(); ++it) {
-      if (it->mac_address == mac_address) {
-        devices_.erase(it);
-        save_devices();
-        return true;
-      }
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    BLEDevice* device = get_device(mac_address);
+    if (device == nullptr) {
+      return false;
     }
-    return false;
+    std::string mac = device->mac_address;
+    uncount_(*device);
+    devices_.erase(devices_.begin() + (device - devices_.data()));
+    rssi_history_.erase(mac);
+    record_deletion_(mac);
+    journal_remove_(mac);
+    return true;
   }
 
-  // Autorizza un dispositivo
+  // Autorizza un dispositivo (duration_seconds = 0: permanente, al massimo
+  // REGISTRY_MAX_DURATION)
   bool authorize_device(const std::string& mac_address, uint32_t duration_seconds = 0) {
-    for (auto& device : devices_) {
-      if (device.mac_address == mac_address) {
-        if (duration_seconds > 0) {
-          // Autorizzazione temporanea
-          device.expiry_time = (millis() / 1000) + duration_seconds;
-        } else {
-          // Autorizzazione permanente
-          device.expiry_time = 0;
-        }
-        save_devices();
-        return true;
-      }
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    BLEDevice* device = get_device(mac_address);
+    if (device == nullptr || duration_seconds > REGISTRY_MAX_DURATION) {
+      return false;
+    }
+    if (duration_seconds > 0) {
+      // Autorizzazione temporanea
+      device->expiry_time = (millis() / 1000) + duration_seconds;
+    } else {
+      // Autorizzazione permanente
+      device->expiry_time = 0;
     }
-    return false;
+    touch_(*device);
+    journal_expiry_(*device);
+    return true;
   }
 
   // Revoca l'autorizzazione di un dispositivo
   bool revoke_authorization(const std::string& mac_address) {
-    for (auto& device : devices_) {
-      if (device.mac_address == mac_address) {
-        device.expiry_time = 1; // Imposta a 1 per indicare scaduto
-        save_devices();
-        return true;
-      }
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    BLEDevice* device = get_device(mac_address);
+    if (device == nullptr) {
+      return false;
     }
-    return false;
+    device->expiry_time = 1; // Imposta a 1 per indicare scaduto
+    touch_(*device);
+    journal_expiry_(*device);
+    return true;
+  }
+
+  // Imposta l'azione per un dispositivo
+  bool set_device_action(const std::string& mac_address, const std::string& action_id) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    BLEDevice* device = get_device(mac_address);
+    if (device == nullptr) {
+      return false;
+    }
+    device->action_id = action_id;
+    touch_(*device);
+    journal_put_(*device);
+    return true;
   }
 
   // Verifica se un dispositivo è autorizzato
   bool is_device_authorized(const std::string& mac_address) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    const BLEDevice* device = get_device(mac_address);
+    if (device == nullptr) {
+      // Dispositivo non trovato
+      return false;
+    }
+    return is_authorized(*device, millis() / 1000);
+  }
+
+  // Autorizzazione permanente o temporanea ancora valida di un dispositivo
+  // già in mano, senza cercarlo di nuovo nel registro
+  static bool is_authorized(const BLEDevice& device, uint32_t current_time) {
+    return device.expiry_time == 0 || device.expiry_time > current_time;
+  }
+
+  // Aggiorna l'ultima rilevazione di un dispositivo.
+  // Le rilevazioni non modificano la revisione: sono dati volatili.
+  void update_device_seen(const std::string& mac_address, int32_t rssi) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    mark_seen_(is_normalized_mac(mac_address) ? mac_address.c_str() : normalize_mac(mac_address).c_str(), rssi);
+  }
+
+  // Imposta la chiave del codice variabile di un dispositivo (ROLLING_KEY_SIZE
+  // byte, vuota per autorizzare di nuovo con il solo MAC)
+  bool set_device_key(const std::string& mac_address, const std::string& key) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (!key.empty() && key.size() != ROLLING_KEY_SIZE) {
+      return false;
+    }
+    BLEDevice* device = get_device(mac_address);
+    if (device == nullptr) {
+      return false;
+    }
+    size_t growth = snapshot_growth_(*device, device->name.size(), device->action_id.size(), key.size());
+    if (growth > 0 && !journal_has_room_(growth)) {
+      return false;
+    }
+    device->rolling_key = key;
+    device->rolling_counter = 0;
+    device->last_token = RollingToken();
+    device->token_seen = 0;
+    device->rolling_tracked = 0;
+    device->rolling_synced = false;
+    touch_(*device);
+    journal_rolling_(*device);
+    return true;
+  }
+
+  // Accoda una rilevazione dello scanner (MAC nei 48 bit bassi, primo byte
+  // più significativo). Costo costante e senza lock: il registro viene
+  // aggiornato nel loop, a blocchi. Se la coda è piena la rilevazione è scartata.
+  // manufacturer_data sono i dati del produttore dell'annuncio (senza
+  // identificativo del produttore) che possono contenere il token a codice variabile.
+  bool ingest_sighting(uint64_t mac, int rssi, const uint8_t* manufacturer_data = nullptr, size_t len = 0) {
+    Sighting sighting;
+    sighting.mac = mac;
+    sighting.timestamp_ms = millis();
+    sighting.rssi = rssi < -128 ? -128 : (rssi > 127 ? 127 : rssi);
+    sighting.has_token = manufacturer_data != nullptr && parse_rolling_token(manufacturer_data, len, &sighting.token);
+    return ingest_ring_.push(sighting);
+  }
+
+  // Contatori della coda delle rilevazioni
+  uint32_t get_ingest_pushed() const { return ingest_ring_.get_pushed(); }
+  uint32_t get_ingest_dropped() const { return ingest_ring_.get_dropped(); }
+  uint32_t get_ingest_deduplicated() const { return ingest_deduplicated_; }
+  uint32_t get_ingest_applied() const { return ingest_applied_; }
+  size_t get_ingest_peak_depth() const { return ingest_ring_.get_peak_depth(); }
+
+  // Stima combinata di tutti i nodi per un dispositivo (false se nessuno lo vede)
+  bool get_fused_estimate(const std::string& mac_address, FusedEstimate* estimate) const {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    uint8_t mac[6];
+    return parse_mac(mac_address, mac) && fusion_.estimate(mac_to_u64(mac), millis(), estimate);
+  }
+
+  // Dispositivo autorizzato più vicino a questo nodo, rilevato negli ultimi
+  // max_age secondi (nullptr se nessuno). Un dispositivo visto più forte da
+  // un altro nodo è più vicino a quello (ad esempio dall'altra parte della
+  // porta) e viene escluso. I dispositivi con chiave devono aver inviato un
+  // token valido ricevuto per la prima volta negli ultimi max_age secondi,
+  // che viene consumato qui e solo per il candidato scelto: ogni token vale
+  // per una sola decisione.
+  const BLEDevice* get_closest_authorized_device(uint32_t max_age = 60) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_BUTTON);
+    uint32_t current_time = millis() / 1000;
+    while (true) {
+      BLEDevice* closest = nullptr;
+      for (auto& device : devices_) {
+        if (device.last_seen == 0 || current_time - device.last_seen >= max_age || 
+            !is_authorized(device, current_time)) {
+          continue;
+        }
+        if (!device.rolling_key.empty() && (device.token_seen == 0 || current_time - device.token_seen >= max_age)) {
+          continue;
+        }
+        FusedEstimate estimate;
+        if (get_fused_estimate(device.mac_address, &estimate) && estimate.nearest_node != fusion_node_id_) {
+          continue;
+        }
+        if (closest == nullptr || device.last_rssi > closest->last_rssi) {
+          closest = &device;
+        }
+      }
+      if (closest == nullptr || closest->rolling_key.empty() || verify_token_(*closest)) {
+        return closest;
+      }
+    }
+  }
+
+  // Contatori delle verifiche dei token
+  const RollingCodeVerifier& get_rolling_verifier() const {
+    return rolling_verifier_;
+  }
+
+  // Trasporto verso gli altri nodi (nullptr se la fusione non è attiva)
+  const FusionLink* get_fusion_link() const {
+    return fusion_link_.get();
+  }
+  uint32_t get_fusion_rejected_packets() const { return fusion_rejected_; }
+  uint32_t get_fusion_foreign_sightings() const { return fusion_foreign_; }
+  uint32_t get_journal_dropped() const { return journal_dropped_; }
+
+  // Ottiene tutti i dispositivi
+  const std::vector<BLEDevice>& get_all_devices() const {
+    return devices_;
+  }
+
+  // Numero di dispositivi registrati
+  size_t get_device_count() const {
+    return devices_.size();
+  }
+
+  // Ottiene il dispositivo in una posizione del registro (nullptr se fuori range).
+  // Permette di scorrere il registro senza copiarlo.
+  const BLEDevice* get_device_at(size_t index) const {
+    if (index >= devices_.size()) {
+      return nullptr;
+    }
+    return &devices_[index];
+  }
+
+  // Ottiene un dispositivo specifico. Un MAC già nel formato del registro
+  // viene cercato senza convertirlo (e senza allocare).
+  BLEDevice* get_device(const std::string& mac_address) {
+    if (!is_normalized_mac(mac_address)) {
+      std::string mac = normalize_mac(mac_address);
+      return mac.empty() ? nullptr : find_device_(mac);
+    }
+    return find_device_(mac_address);
+  }
+
+  // Ottiene lo storico RSSI di un dispositivo (nullptr se mai rilevato)
+  const RSSIHistory* get_rssi_history(const std::string& mac_address) const {
+    auto it = rssi_history_.find(is_normalized_mac(mac_address) ? mac_address : normalize_mac(mac_address));
+    if (it == rssi_history_.end()) {
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+  // Inizia un gruppo di modifiche: nel giornale le modifiche fino a
+  // end_batch() vengono applicate all'avvio solo se il gruppo è completo.
+  // Il registro resta bloccato fino a end_batch().
+  void begin_batch() {
+    mutex_.lock();
+    if (batch_depth_++ == 0 && journal_) {
+      journal_->begin_transaction();
+    }
+  }
+
+  // Termina un gruppo di modifiche
+  void end_batch() {
+    if (batch_depth_ > 0 && --batch_depth_ == 0 && journal_) {
+      journal_->end_transaction();
+    }
+    mutex_.unlock();
+  }
+
+  // Applica un gruppo di operazioni in modo atomico: prima vengono tutte
+  // verificate sullo stato che il registro avrebbe dopo le precedenti, poi,
+  // solo se sono tutte valide, applicate in un'unica transazione del giornale.
+  // Se un'operazione non riesce comunque, il gruppo viene annullato sia in
+  // memoria sia nel giornale.
+  // errors riceve per ogni operazione nullptr (riuscita) o il messaggio di errore.
+  bool apply_batch(const std::vector<BatchOperation>& operations, std::vector<const char*>* errors) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    errors->assign(operations.size(), nullptr);
+    
+    // Stato simulato dei dispositivi toccati dal gruppo: presenza e
+    // lunghezza dei campi che occupano spazio nello snapshot
+    struct Simulated {
+      bool present = false;
+      size_t name_len = 0;
+      size_t action_len = 0;
+      size_t key_len = 0;
+    };
+    std::map<std::string, Simulated> simulated;
+    size_t device_count = devices_.size();
+    size_t added_bytes = 0;
+    bool valid = true;
+    for (size_t i = 0; i < operations.size(); i++) {
+      const auto& op = operations[i];
+      if (op.error != nullptr) {
+        (*errors)[i] = op.error;
+        valid = false;
+        continue;
+      }
+      
+      auto it = simulated.find(op.mac_address);
+      if (it == simulated.end()) {
+        Simulated state;
+        const BLEDevice* device = find_device_(op.mac_address);
+        if (device != nullptr) {
+          state.present = true;
+          state.name_len = device->name.size();
+          state.action_len = device->action_id.size();
+          state.key_len = device->rolling_key.size();
+        }
+        it = simulated.emplace(op.mac_address, state).first;
+      }
+      Simulated& state = it->second;
+      size_t size_before = state.present ? snapshot_record_size_(state.name_len, state.action_len, state.key_len) : 0;
+      if (op.type == BatchOperation::ADD) {
+        if (!state.present && ++device_count > REGISTRY_MAX_DEVICES) {
+          (*errors)[i] = "Registro pieno";
+          valid = false;
+        }
+        if (!state.present) {
+          state.present = true;
+          state.action_len = 0;
+          state.key_len = 0;
+        }
+        state.name_len = op.name.size();
+        if (!op.action_id.empty()) {
+          state.action_len = op.action_id.size();
+        }
+      } else if (!state.present) {
+        (*errors)[i] = "Dispositivo non trovato";
+        valid = false;
+        continue;
+      } else if (op.type == BatchOperation::REMOVE) {
+        device_count--;
+        state.present = false;
+      } else if (op.type == BatchOperation::SET_ACTION) {
+        state.action_len = op.action_id.size();
+      } else if (op.type == BatchOperation::SET_KEY) {
+        state.key_len = op.key.size();
+      }
+      
+      // Le operazioni che fanno crescere lo snapshot devono starci
+      size_t size_after = state.present ? snapshot_record_size_(state.name_len, state.action_len, state.key_len) : 0;
+      if (size_after > size_before) {
+        added_bytes += size_after - size_before;
+        if ((*errors)[i] == nullptr && !journal_has_room_(added_bytes)) {
+          (*errors)[i] = "Memoria di salvataggio piena";
+          valid = false;
+        }
+      }
+    }
+    if (!valid) {
+      return false;
+    }
+    
+    // Copia dei dispositivi toccati, per annullare il gruppo
+    std::vector<BLEDevice> previous;
+    for (const auto& entry : simulated) {
+      const BLEDevice* device = find_device_(entry.first);
+      if (device != nullptr) {
+        previous.push_back(*device);
+      }
+    }
+    
+    begin_batch();
+    for (size_t i = 0; i < operations.size(); i++) {
+      const auto& op = operations[i];
+      bool applied = false;
+      switch (op.type) {
+        case BatchOperation::ADD:
+          applied = add_device(op.mac_address, op.name, op.action_id);
+          break;
+        case BatchOperation::SET_ACTION:
+          applied = set_device_action(op.mac_address, op.action_id);
+          break;
+        case BatchOperation::AUTHORIZE:
+          applied = authorize_device(op.mac_address, op.duration);
+          break;
+        case BatchOperation::REVOKE:
+          applied = revoke_authorization(op.mac_address);
+          break;
+        case BatchOperation::REMOVE:
+          applied = remove_device(op.mac_address);
+          break;
+        case BatchOperation::SET_KEY:
+          applied = set_device_key(op.mac_address, op.key);
+          break;
+      }
+      if (!applied) {
+        (*errors)[i] = "Operazione non riuscita";
+        for (const auto& entry : simulated) {
+          restore_device_(entry.first, previous);
+        }
+        abort_batch_();
+        return false;
+      }
+    }
+    end_batch();
+    return true;
+  }
+
+  // Importa un insieme di record già validati come un'unica transazione:
+  // i dispositivi esistenti vengono aggiornati, i nuovi aggiunti. false (e
+  // nessuna modifica) se i nuovi dispositivi superano la capienza del registro
+  // o lo spazio della partizione di salvataggio.
+  bool import_records(const std::vector<RegistryRecord>& records) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    std::map<std::string, bool> added;
+    size_t device_count = devices_.size();
+    size_t added_bytes = 0;
+    for (const auto& record : records) {
+      std::string mac = format_mac(record.mac);
+      if (find_device_(mac) == nullptr && added.emplace(mac, true).second) {
+        added_bytes += snapshot_record_size_(record.name.size(), record.action_id.size(), 0);
+        if (++device_count > REGISTRY_MAX_DEVICES) {
+          return false;
+        }
+      }
+    }
+    if (!journal_has_room_(added_bytes)) {
+      return false;
+    }
+    
+    uint32_t current_time = millis() / 1000;
+    begin_batch();
+    for (const auto& record : records) {
+      journal_put_(apply_record_(record, expiry_from_record_(record.expires_in, current_time)));
+    }
+    end_batch();
+    return true;
+  }
+
+  // Converte un dispositivo nel formato di scambio usato da import/export
+  RegistryRecord to_record(const BLEDevice& device) const {
+    RegistryRecord record;
+    parse_mac(device.mac_address, record.mac);
+    record.name = device.name;
+    record.action_id = device.action_id;
+    record.expires_in = get_expires_in(device);
+    return record;
+  }
+
+  // Secondi mancanti alla scadenza dell'autorizzazione, indipendenti dal
+  // tempo dall'avvio (REGISTRY_EXPIRES_NEVER = permanente,
+  // REGISTRY_EXPIRES_REVOKED = revocata o scaduta)
+  uint32_t get_expires_in(const BLEDevice& device) const {
+    if (device.expiry_time == 0) {
+      return REGISTRY_EXPIRES_NEVER;
+    }
+    uint32_t current_time = millis() / 1000;
+    return device.expiry_time > current_time + 1 ? device.expiry_time - current_time : REGISTRY_EXPIRES_REVOKED;
+  }
+
+  // Revisione corrente del registro, incrementata ad ogni modifica
+  uint32_t get_revision() const { return revision_; }
+
+  // Identificativo dell'avvio corrente (cambia ad ogni riavvio)
+  uint32_t get_epoch() const { return epoch_; }
+
+  // Indica se le modifiche successive alla revisione since dell'avvio epoch
+  // possono essere ricostruite. Dopo un riavvio le revisioni ripartono e le
+  // eliminazioni precedenti non sono più note: serve anche l'avvio giusto.
+  // Se false il client deve riscaricare l'intero registro.
+  bool can_sync_since(uint32_t epoch, uint32_t since) const {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return epoch == epoch_ && since >= deleted_floor_ && since <= revision_;
+  }
+
+  // Ottiene i dispositivi modificati dopo la revisione since
+  std::vector<const BLEDevice*> get_devices_changed_since(uint32_t since) const {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    std::vector<const BLEDevice*> changed;
     for (const auto& device : devices_) {
+      if (device.revision > since) {
+        changed.push_back(&device);
+      }
+    }
+    return changed;
+  }
+
+  // Ottiene le eliminazioni recenti (in ordine di revisione)
+  const std::vector<DeletedDevice>& get_deleted_devices() const {
+    return deleted_;
+  }
+
+ private:
+  std::vector<BLEDevice> devices_;
+  std::map<std::string, RSSIHistory> rssi_history_;
+  std::vector<DeletedDevice> deleted_;
+  uint32_t revision_ = 0;
+  uint32_t deleted_floor_ = 0; // Revisione più vecchia da cui la sincronizzazione è possibile
+  uint32_t epoch_ = 0;
+  uint32_t batch_depth_ = 0;
+  mutable std::recursive_mutex mutex_;
+  
+  // Persistenza
+  std::string storage_partition_ = "blekm";
+  FlashDevice* flash_ = nullptr;
+  std::unique_ptr<JournalStore> journal_;
+  std::string snapshot_cursor_; // Ultimo MAC scritto nello snapshot in corso
+  // Orologio del giornale: secondi di funzionamento accumulati su tutti gli
+  // avvii, salvato periodicamente. Le scadenze nel giornale sono istanti di
+  // questo orologio, così un riavvio non allunga le autorizzazioni.
+  uint32_t clock_base_ = 0;         // Valore all'avvio
+  uint64_t clock_elapsed_ms_ = 0;   // Tempo trascorso dall'avvio
+  uint32_t clock_last_ms_ = 0;
+  uint32_t checkpoint_time_ = 0;    // Ultimo salvataggio periodico
+  size_t compaction_checked_free_ = SIZE_MAX;
+  uint32_t journal_dropped_ = 0;    // Modifiche non salvate
+  bool journal_failing_ = false;
+  
+  // Coda delle rilevazioni
+  SightingRing<INGEST_RING_SIZE> ingest_ring_;
+  SightingDeduplicator deduplicator_;
+  uint32_t ingest_deduplicated_ = 0;
+  uint32_t ingest_applied_ = 0;
+  
+  // Fusione con gli altri nodi
+  SightingFusion fusion_;
+  SightingBatchEncoder fusion_outgoing_;
+  std::unique_ptr<FusionLink> fusion_link_;
+  std::vector<std::string> fusion_peers_;
+  std::vector<uint32_t> fusion_peer_nodes_; // Identificativo usato da ogni nodo configurato
+  uint32_t fusion_node_id_ = 0;
+  uint16_t fusion_port_ = 0;
+  uint32_t fusion_interval_ = 200;
+  uint32_t fusion_last_send_ = 0;
+  uint32_t fusion_rejected_ = 0;
+  uint32_t fusion_foreign_ = 0;   // Rilevazioni ricevute di dispositivi non registrati
+  
+  RollingCodeVerifier rolling_verifier_;
+  
+  // Contatori aggregati
+  uint32_t active_window_ = 300;
+  uint32_t authorized_count_ = 0;
+  uint32_t active_count_ = 0;
+  uint32_t next_deadline_ = UINT32_MAX; // Prossimo istante in cui un conteggio può cambiare
+#ifdef USE_SENSOR
+  sensor::Sensor *authorized_sensor_ = nullptr;
+  sensor::Sensor *active_sensor_ = nullptr;
+  sensor::Sensor *expired_sensor_ = nullptr;
+  uint32_t min_publish_interval_ = 1000;
+  uint32_t last_publish_ = 0;
+#endif
+
+  // Cerca un dispositivo per MAC già normalizzato
+  BLEDevice* find_device_(const std::string& mac_address) {
+    for (auto& device : devices_) {
       if (device.mac_address == mac_address) {
-        if (device.expiry_time == 0) {
-          // Autorizzazione permanente
-          return true;
-        } else if (device.expiry_time > (millis() / 1000)) {
-          // Autorizzazione temporanea ancora valida
-          return true;
-        }
-        // Autorizzazione scaduta
-        return false;
+        return &device;
       }
     }
-    // Dispositivo non trovato
-    return false;
+    return nullptr;
   }
 
-  // Aggiorna l'ultima rilevazione di un dispositivo
-  void update_device_seen(const std::string& mac_address, int32_t rssi) {
+  // Come sopra, senza creare una stringa (percorso delle rilevazioni)
+  BLEDevice* find_device_(const char* mac_address) {
     for (auto& device : devices_) {
       if (device.mac_address == mac_address) {
-        device.last_seen = millis() / 1000;
-        device.last_rssi = rssi;
+        return &device;
+      }
+    }
+    return nullptr;
+  }
+
+  // Segna un record come modificato
+  void touch_(BLEDevice& device) {
+    device.revision = ++revision_;
+    update_counts_(device, millis() / 1000);
+  }
+
+  // Aggiorna i contatori aggregati con lo stato attuale del dispositivo e
+  // anticipa il prossimo controllo se il suo stato cambierà prima
+  void update_counts_(BLEDevice& device, uint32_t current_time) {
+    bool authorized = is_authorized(device, current_time);
+    bool active = device.last_seen > 0 && current_time - device.last_seen < active_window_;
+    
+    if (authorized != device.counted_authorized) {
+      authorized ? authorized_count_++ : authorized_count_--;
+      device.counted_authorized = authorized;
+    }
+    if (active != device.counted_active) {
+      active ? active_count_++ : active_count_--;
+      device.counted_active = active;
+    }
+    
+    if (device.expiry_time > current_time && device.expiry_time < next_deadline_) {
+      next_deadline_ = device.expiry_time;
+    }
+    if (active && device.last_seen + active_window_ < next_deadline_) {
+      next_deadline_ = device.last_seen + active_window_;
+    }
+  }
+
+  // Toglie un dispositivo dai contatori aggregati
+  void uncount_(const BLEDevice& device) {
+    if (device.counted_authorized) authorized_count_--;
+    if (device.counted_active) active_count_--;
+  }
+
+#ifdef USE_SENSOR
+  // Pubblica i contatori cambiati, al massimo una volta per intervallo
+  void publish_counts_() {
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_SENSORS);
+    uint32_t now = millis();
+    if (last_publish_ != 0 && now - last_publish_ < min_publish_interval_) {
+      return;
+    }
+    bool published = publish_if_changed_(authorized_sensor_, get_authorized_count());
+    published |= publish_if_changed_(active_sensor_, get_active_count());
+    published |= publish_if_changed_(expired_sensor_, get_expired_count());
+    if (published) {
+      last_publish_ = now;
+    }
+  }
+
+  bool publish_if_changed_(sensor::Sensor *sensor, uint32_t value) {
+    if (sensor == nullptr || (sensor->has_state() && sensor->state == value)) {
+      return false;
+    }
+    sensor->publish_state(value);
+    return true;
+  }
+#endif
+
+  // Annulla il gruppo di modifiche aperto da begin_batch(): all'avvio le
+  // modifiche del gruppo già scritte nel giornale vengono scartate
+  void abort_batch_() {
+    if (batch_depth_ > 0 && --batch_depth_ == 0 && journal_) {
+      journal_written_(journal_->abort_transaction());
+    }
+    mutex_.unlock();
+  }
+
+  // Riporta un dispositivo allo stato salvato in previous (eliminandolo se
+  // non c'era), come nuova modifica per chi sincronizza il registro
+  void restore_device_(const std::string& mac_address, const std::vector<BLEDevice>& previous) {
+    const BLEDevice* saved = nullptr;
+    for (const auto& device : previous) {
+      if (device.mac_address == mac_address) {
+        saved = &device;
+        break;
+      }
+    }
+    BLEDevice* current = find_device_(mac_address);
+    if (saved == nullptr) {
+      if (current != nullptr) {
+        uncount_(*current);
+        devices_.erase(devices_.begin() + (current - devices_.data()));
+        rssi_history_.erase(mac_address);
+        record_deletion_(mac_address);
+      }
+      return;
+    }
+    if (current == nullptr) {
+      forget_deletion_(mac_address);
+      devices_.emplace_back();
+      current = &devices_.back();
+    } else {
+      uncount_(*current);
+    }
+    *current = *saved;
+    current->counted_authorized = false;
+    current->counted_active = false;
+    touch_(*current);
+  }
+
+  // Registra l'eliminazione di un dispositivo
+  void record_deletion_(const std::string& mac_address) {
+    DeletedDevice deleted;
+    deleted.mac_address = mac_address;
+    deleted.revision = ++revision_;
+    
+    if (deleted_.size() >= MAX_DELETED_DEVICES) {
+      // Le eliminazioni più vecchie vengono dimenticate: chi è fermo a una
+      // revisione precedente dovrà risincronizzarsi completamente
+      deleted_floor_ = deleted_.front().revision;
+      deleted_.erase(deleted_.begin());
+    }
+    deleted_.push_back(deleted);
+  }
+
+  // Un dispositivo eliminato e poi aggiunto di nuovo compare tra i modificati
+  // con una revisione più alta: l'eliminazione non va più riportata
+  void forget_deletion_(const std::string& mac_address) {
+    for (auto it = deleted_.begin(); it != deleted_.end(); ++it) {
+      if (it->mac_address == mac_address) {
+        deleted_.erase(it);
         return;
       }
     }
   }
 
-  // Ottiene tutti i dispositivi
-  std::vector<BLEDevice> get_all_devices() {
-    return devices_;
+  // Applica al registro un blocco di rilevazioni accodate
+  void drain_ingest_() {
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_INGEST);
+    Sighting batch[INGEST_BATCH_SIZE];
+    size_t count = ingest_ring_.pop(batch, INGEST_BATCH_SIZE);
+    for (size_t i = 0; i < count; i++) {
+      if (!deduplicator_.accept(batch[i])) {
+        ingest_deduplicated_++;
+        continue;
+      }
+      uint8_t mac[6];
+      char mac_text[18];
+      u64_to_mac(batch[i].mac, mac);
+      format_mac(mac, mac_text);
+      BLEDevice* device = mark_seen_(mac_text, batch[i].rssi);
+      ingest_applied_++;
+      if (device == nullptr) {
+        continue;
+      }
+      if (batch[i].has_token && !device->rolling_key.empty() && batch[i].token.counter != device->last_token.counter &&
+          (device->rolling_tracked == 0 || device->last_seen - device->rolling_tracked >= ROLLING_TRACK_INTERVAL)) {
+        track_token_(*device, batch[i].token);
+      }
+      
+      // Solo i dispositivi registrati entrano nella fusione e nei pacchetti:
+      // i MAC casuali dei telefoni sostituirebbero le tracce dei badge
+      fusion_.add(fusion_node_id_, batch[i].mac, batch[i].rssi, batch[i].timestamp_ms);
+      if (fusion_link_ && !fusion_outgoing_.add(batch[i])) {
+        send_fusion_batch_();
+        fusion_outgoing_.add(batch[i]);
+      }
+    }
   }
 
-  // Ottiene un dispositivo specifico
-  BLEDevice* get_device(const std::string& mac_address) {
+  // Riceve i pacchetti degli altri nodi e invia periodicamente le proprie rilevazioni
+  void fusion_step_() {
+    if (!fusion_link_) {
+      return;
+    }
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_FUSION);
+    fusion_link_->poll([this](const uint8_t* data, size_t len, size_t peer) {
+      uint32_t node_id, send_time;
+      std::vector<Sighting> sightings;
+      // Ogni nodo configurato può usare un solo identificativo, il primo
+      // ricevuto: un nodo non può occupare altri posti della fusione
+      if (!decode_sighting_batch(data, len, &node_id, &send_time, &sightings) || node_id == fusion_node_id_ ||
+          (fusion_peer_nodes_[peer] != FUSION_NODE_UNKNOWN && fusion_peer_nodes_[peer] != node_id) ||
+          !fusion_.observe_clock(node_id, send_time, millis())) {
+        fusion_rejected_++;
+        return;
+      }
+      fusion_peer_nodes_[peer] = node_id;
+      for (const auto& sighting : sightings) {
+        uint8_t mac[6];
+        char mac_text[18];
+        u64_to_mac(sighting.mac, mac);
+        format_mac(mac, mac_text);
+        if (find_device_(mac_text) == nullptr) {
+          fusion_foreign_++;
+          continue;
+        }
+        fusion_.add(node_id, sighting.mac, sighting.rssi, fusion_.to_local_time(node_id, sighting.timestamp_ms));
+      }
+    }, FUSION_PACKETS_PER_LOOP);
+    
+    if (!fusion_outgoing_.empty() && millis() - fusion_last_send_ >= fusion_interval_) {
+      send_fusion_batch_();
+    }
+  }
+
+  void send_fusion_batch_() {
+    fusion_last_send_ = millis();
+    fusion_link_->send(fusion_outgoing_.finish(fusion_node_id_, fusion_last_send_));
+  }
+
+  // Aggiorna l'ultima rilevazione; restituisce il dispositivo (nullptr se non registrato).
+  // Non alloca se il dispositivo ha già uno storico RSSI.
+  BLEDevice* mark_seen_(const char* mac_address, int32_t rssi) {
     for (auto& device : devices_) {
       if (device.mac_address == mac_address) {
+        device.last_seen = millis() / 1000;
+        device.last_rssi = rssi;
+        rssi_history_[device.mac_address].add_sample(device.last_seen, rssi);
+        update_counts_(device, device.last_seen);
         return &device;
       }
     }
     return nullptr;
   }
 
- private:
-  std::vector<BLEDevice> devices_;
+  // Verifica l'ultimo token del dispositivo e lo consuma. Il contatore
+  // accettato viene salvato, così un token già usato resta rifiutato anche
+  // dopo un riavvio.
+  bool verify_token_(BLEDevice& device) {
+    uint8_t mac[6];
+    device.token_seen = 0;
+    if (!parse_mac(device.mac_address, mac)) {
+      return false;
+    }
+    RollingVerdict verdict = rolling_verifier_.verify(reinterpret_cast<const uint8_t*>(device.rolling_key.data()),
+                                                      device.rolling_key.size(), mac, device.last_token,
+                                                      &device.rolling_counter);
+    if (verdict != ROLLING_OK) {
+      ESP_LOGW(BLE_KEY_MANAGER_TAG, "Token di %s rifiutato (%s)", device.mac_address.c_str(),
+               verdict == ROLLING_REPLAYED ? "ripetuto" : (verdict == ROLLING_BAD_TAG ? "firma errata" : "fuori finestra"));
+      return false;
+    }
+    journal_rolling_(device);
+    return true;
+  }
+
+  // Controlla la firma di un token nuovo alla ricezione, senza consumarlo.
+  // Solo un token valido diventa utilizzabile per una decisione, e token_seen
+  // resta l'istante della sua prima ricezione: ripetere un token già
+  // ricevuto (ad esempio intercettato mentre il badge si allontana) non lo
+  // rinnova, e i token precedenti smettono di valere.
+  // Il primo controllo dopo l'avvio o il cambio di chiave può riallineare il
+  // contatore oltre la finestra, ma consuma il token: potrebbe essere stato
+  // trasmesso, e intercettato, prima dell'ultimo salvataggio del contatore.
+  // L'avanzamento viene salvato con i salvataggi periodici.
+  void track_token_(BLEDevice& device, const RollingToken& token) {
+    uint8_t mac[6];
+    device.rolling_tracked = device.last_seen;
+    if (!parse_mac(device.mac_address, mac) ||
+        !rolling_verifier_.track(reinterpret_cast<const uint8_t*>(device.rolling_key.data()), device.rolling_key.size(),
+                                 mac, token, &device.rolling_counter, device.rolling_synced)) {
+      return;
+    }
+    device.last_token = token;
+    if (!device.rolling_synced) {
+      device.rolling_synced = true;
+      device.rolling_counter = token.counter;
+      device.token_seen = 0;
+      return;
+    }
+    device.token_seen = device.last_seen;
+  }
+
+  // Aggiunge o aggiorna un dispositivo con i dati di un record (senza
+  // scriverlo nel giornale); expiry_time nel formato di BLEDevice
+  BLEDevice& apply_record_(const RegistryRecord& record, uint32_t expiry_time) {
+    std::string mac = format_mac(record.mac);
+    BLEDevice* device = get_device(mac);
+    if (device == nullptr) {
+      forget_deletion_(mac);
+      devices_.emplace_back();
+      device = &devices_.back();
+      device->mac_address = mac;
+    }
+    device->name = record.name;
+    device->action_id = record.action_id;
+    device->expiry_time = expiry_time;
+    touch_(*device);
+    return *device;
+  }
+
+  static uint32_t expiry_from_record_(uint32_t expires_in, uint32_t current_time) {
+    if (expires_in == REGISTRY_EXPIRES_NEVER || expires_in == REGISTRY_EXPIRES_REVOKED) {
+      return expires_in;
+    }
+    return current_time + expires_in;
+  }
+
+  // Orologio del giornale; il tempo viene accumulato a ogni lettura, così
+  // il ritorno a zero di millis() non lo fa tornare indietro
+  uint32_t journal_clock_() {
+    uint32_t now = millis();
+    clock_elapsed_ms_ += now - clock_last_ms_;
+    clock_last_ms_ = now;
+    return clock_base_ + static_cast<uint32_t>(clock_elapsed_ms_ / 1000);
+  }
+
+  // Record da scrivere nel giornale: la scadenza è l'istante dell'orologio
+  // del giornale, non i secondi mancanti
+  RegistryRecord journal_record_(const BLEDevice& device) {
+    RegistryRecord record = to_record(device);
+    if (record.expires_in != REGISTRY_EXPIRES_NEVER && record.expires_in != REGISTRY_EXPIRES_REVOKED) {
+      record.expires_in += journal_clock_();
+    }
+    return record;
+  }
+
+  // Salvataggio periodico: l'orologio del giornale, mentre ci sono
+  // autorizzazioni temporanee da far scadere anche attraverso i riavvii, e i
+  // contatori avanzati alla ricezione dei token, così dopo un riavvio non
+  // tornano a valere i token trasmessi prima dell'ultimo salvataggio
+  void checkpoint_() {
+    if (!journal_ || journal_clock_() - checkpoint_time_ < CLOCK_CHECKPOINT_INTERVAL) {
+      return;
+    }
+    checkpoint_time_ = journal_clock_();
+    bool timed = false;
+    for (auto& device : devices_) {
+      if (device.expiry_time > 1) {
+        timed = true;
+      }
+      if (device.rolling_counter != device.rolling_saved) {
+        journal_rolling_(device);
+      }
+    }
+    if (timed) {
+      journal_->append_clock(checkpoint_time_);
+    }
+  }
+
+  // Spazio di un dispositivo nello snapshot (record del dispositivo più,
+  // se ha una chiave, quello del codice variabile)
+  static size_t snapshot_record_size_(size_t name_len, size_t action_len, size_t key_len) {
+    size_t size = JournalStore::record_size(6 + 1 + name_len + 1 + action_len + 5);
+    if (key_len > 0) {
+      size += JournalStore::record_size(6 + 1 + key_len + 5);
+    }
+    return size;
+  }
+
+  // Spazio in più nello snapshot se i campi del dispositivo passano alle
+  // lunghezze indicate (0 se non cresce)
+  static size_t snapshot_growth_(const BLEDevice& device, size_t name_len, size_t action_len, size_t key_len) {
+    size_t before = snapshot_record_size_(device.name.size(), device.action_id.size(), device.rolling_key.size());
+    size_t after = snapshot_record_size_(name_len, action_len, key_len);
+    return after > before ? after - before : 0;
+  }
+
+  // Settori occupati da uno snapshot con extra_bytes di dispositivi in più
+  size_t snapshot_sectors_(size_t extra_bytes) const {
+    size_t bytes = extra_bytes + 2 * JournalStore::record_size(8);
+    size_t max_record = JournalStore::record_size(6 + 1 + 32 + 5);
+    for (const auto& device : devices_) {
+      bytes += snapshot_record_size_(device.name.size(), device.action_id.size(), device.rolling_key.size());
+      max_record = std::max(max_record, snapshot_record_size_(device.name.size(), device.action_id.size(), 0));
+    }
+    return journal_->sectors_for(bytes, max_record);
+  }
+
+  // Indica se la partizione può contenere il registro con extra_bytes di
+  // dispositivi in più: servono due snapshot completi più i settori di
+  // riserva, altrimenti la compattazione non avrebbe più spazio
+  bool journal_has_room_(size_t extra_bytes) const {
+    if (!journal_) {
+      return true;
+    }
+    return 2 * snapshot_sectors_(extra_bytes) + JOURNAL_SPARE_SECTORS <= journal_->get_sector_count();
+  }
+
+  // Conta le modifiche che non è stato possibile salvare; il componente resta
+  // in stato di avviso finché una scrittura non riesce di nuovo
+  void journal_written_(bool written) {
+    if (written) {
+      if (journal_failing_) {
+        journal_failing_ = false;
+        status_clear_warning();
+        ESP_LOGI(BLE_KEY_MANAGER_TAG, "Scrittura del giornale ripresa");
+      }
+      return;
+    }
+    journal_dropped_++;
+    if (!journal_failing_) {
+      journal_failing_ = true;
+      status_set_warning();
+      ESP_LOGE(BLE_KEY_MANAGER_TAG, "Scrittura del giornale non riuscita: le modifiche non saranno conservate al riavvio");
+    }
+  }
+
+  // Scrittura delle modifiche nel giornale: un record per modifica
+  void journal_put_(const BLEDevice& device) {
+    if (journal_) {
+      journal_written_(journal_->append_put(journal_record_(device)));
+    }
+  }
+
+  void journal_expiry_(const BLEDevice& device) {
+    if (journal_) {
+      RegistryRecord record = journal_record_(device);
+      journal_written_(journal_->append_expiry(record.mac, record.expires_in));
+    }
+  }
+
+  void journal_rolling_(BLEDevice& device) {
+    uint8_t mac[6];
+    device.rolling_saved = device.rolling_counter;
+    if (journal_ && parse_mac(device.mac_address, mac)) {
+      journal_written_(journal_->append_rolling(mac, device.rolling_key, device.rolling_counter));
+    }
+  }
 
-  // Carica i dispositivi salvati
+  void journal_remove_(const std::string& mac_address) {
+    uint8_t mac[6];
+    if (journal_ && parse_mac(mac_address, mac)) {
+      journal_written_(journal_->append_remove(mac));
+    }
+  }
+
+  // Carica i dispositivi salvati rileggendo il giornale.
+  // Le scadenze sono salvate come istanti dell'orologio del giornale, che
+  // riparte dall'ultimo valore salvato: il tempo di funzionamento prima del
+  // riavvio viene scalato, quello a dispositivo spento non viene conteggiato.
   void load_devices() {
-    // Implementazione del caricamento da memoria persistente
-    // Esempio: caricamento da file o preferenze
-    // Per semplicità, qui non implementato completamente
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_STORAGE);
+#ifdef USE_ESP32
+    if (flash_ == nullptr) {
+      flash_ = ESP32PartitionFlash::open(storage_partition_.c_str());
+    }
+#endif
+    if (flash_ == nullptr) {
+      ESP_LOGE(BLE_KEY_MANAGER_TAG, "Partizione '%s' non trovata: il registro non verrà salvato",
+               storage_partition_.c_str());
+      status_set_warning();
+      return;
+    }
+    
+    journal_.reset(new JournalStore(flash_));
+    // Durante la lettura expiry_time contiene la scadenza nell'orologio del
+    // giornale, convertita alla fine quando l'ultimo valore dell'orologio è noto
+    uint32_t clock = 0;
+    journal_->load([this, &clock](const JournalEntry& entry) {
+      std::string mac = format_mac(entry.record.mac);
+      if (entry.type == JOURNAL_CLOCK) {
+        clock = std::max(clock, entry.counter);
+      } else if (entry.type == JOURNAL_PUT) {
+        apply_record_(entry.record, entry.record.expires_in);
+      } else if (entry.type == JOURNAL_EXPIRY) {
+        BLEDevice* device = get_device(mac);
+        if (device != nullptr) {
+          device->expiry_time = entry.record.expires_in;
+          touch_(*device);
+        }
+      } else if (entry.type == JOURNAL_ROLLING) {
+        BLEDevice* device = get_device(mac);
+        if (device != nullptr) {
+          device->rolling_key = entry.key;
+          device->rolling_counter = entry.counter;
+          device->rolling_saved = entry.counter;
+        }
+      } else if (entry.type == JOURNAL_REMOVE) {
+        for (auto it = devices_.begin(); it != devices_.end(); ++it) {
+          if (it->mac_address == mac) {
+            uncount_(*it);
+            devices_.erase(it);
+            break;
+          }
+        }
+      }
+    });
+    
+    uint32_t current_time = millis() / 1000;
+    for (auto& device : devices_) {
+      if (device.expiry_time > 1) {
+        device.expiry_time = device.expiry_time > clock ? current_time + (device.expiry_time - clock) : 1;
+      }
+    }
+    next_deadline_ = 0; // I contatori vengono ricalcolati al primo ciclo
+    clock_base_ = clock;
+    clock_elapsed_ms_ = 0;
+    clock_last_ms_ = millis();
+    checkpoint_time_ = clock;
+    journal_->append_clock(clock);
+    if (!journal_has_room_(0)) {
+      ESP_LOGE(BLE_KEY_MANAGER_TAG, "Partizione '%s' troppo piccola per il registro: nuovi dispositivi rifiutati",
+               storage_partition_.c_str());
+      status_set_warning();
+    }
+    ESP_LOGI(BLE_KEY_MANAGER_TAG, "Caricati %u dispositivi dal giornale (%u/%u settori in uso)",
+             static_cast<unsigned>(devices_.size()), static_cast<unsigned>(journal_->get_live_sectors()),
+             static_cast<unsigned>(journal_->get_sector_count()));
   }
 
-  // Salva i dispositivi
-  void save_devices() {
-    // Implementazione del salvataggio in memoria persistente
-    // Esempio: salvataggio su file o preferenze
-    // Per semplicità, qui non implementato completamente
+  // Scrive uno snapshot del registro a piccoli passi. I dispositivi vengono
+  // scritti in ordine di MAC ripartendo ogni volta dall'ultimo scritto, così
+  // aggiunte ed eliminazioni durante lo snapshot non fanno saltare record:
+  // le modifiche successive all'inizio dello snapshot sono comunque nel
+  // giornale e vengono riapplicate all'avvio.
+  void compact_step_() {
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_STORAGE);
+    if (!journal_) {
+      return;
+    }
+    if (!journal_->is_snapshot_active()) {
+      // Oltre alla soglia del giornale, lo snapshot parte quando i settori
+      // liberi bastano appena per scriverlo (controllato solo quando cambia
+      // il numero di settori in uso)
+      bool start = journal_->needs_compaction();
+      size_t free_sectors = journal_->get_free_sectors();
+      if (!start && free_sectors != compaction_checked_free_) {
+        compaction_checked_free_ = free_sectors;
+        start = free_sectors < snapshot_sectors_(0) + JOURNAL_SPARE_SECTORS;
+      }
+      if (!start || !journal_->begin_snapshot(journal_clock_())) {
+        return;
+      }
+      compaction_checked_free_ = SIZE_MAX;
+      snapshot_cursor_.clear();
+    }
+    
+    for (size_t i = 0; i < SNAPSHOT_DEVICES_PER_LOOP; i++) {
+      const BLEDevice* next = nullptr;
+      for (const auto& device : devices_) {
+        if (device.mac_address > snapshot_cursor_ &&
+            (next == nullptr || device.mac_address < next->mac_address)) {
+          next = &device;
+        }
+      }
+      if (next == nullptr) {
+        journal_->end_snapshot();
+        return;
+      }
+      if (!journal_->append_snapshot_device(journal_record_(*next))) {
+        return; // Riprova al prossimo ciclo
+      }
+      uint8_t mac[6];
+      if (!next->rolling_key.empty() && parse_mac(next->mac_address, mac) &&
+          !journal_->append_rolling(mac, next->rolling_key, next->rolling_counter)) {
+        return;
+      }
+      snapshot_cursor_ = next->mac_address;
+    }
   }
 
   // Controlla le autorizzazioni scadute
+  // Il registro viene scorso solo quando scade l'autorizzazione o la finestra
+  // di attività più vicina, non ad ogni ciclo
   void check_expired_authorizations() {
+    BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_EXPIRY);
     uint32_t current_time = millis() / 1000;
+    if (current_time < next_deadline_) {
+      return;
+    }
+    
+    next_deadline_ = UINT32_MAX;
     for (auto& device : devices_) {
-      if (device.expiry_time > 0 && device.expiry_time <= current_time) {
+      if (device.expiry_time > 1 && device.expiry_time <= current_time) {
         // Autorizzazione scaduta, imposta a 1 per indicare scaduto
         device.expiry_time = 1;
+        touch_(device);
+        journal_expiry_(device);
+      } else {
+        update_counts_(device, current_time);
       }
     }
   }
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "rolling_code.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+
+// Rilevazione BLE a dimensione fissa, come arriva dallo scanner
+struct Sighting {
+  uint64_t mac = 0;          // MAC nei 48 bit bassi
+  uint32_t timestamp_ms = 0;
+  int8_t rssi = 0;
+  bool has_token = false;    // Annuncio con token a codice variabile
+  RollingToken token;
+};
+
+// Conversione tra MAC in byte (primo byte più significativo) e intero a 48 bit
+inline uint64_t mac_to_u64(const uint8_t *mac) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < 6; i++) {
+    value = (value << 8) | mac[i];
+  }
+  return value;
+}
+
+inline void u64_to_mac(uint64_t value, uint8_t *mac) {
+  for (size_t i = 0; i < 6; i++) {
+    mac[i] = value >> (8 * (5 - i));
+  }
+}
+
+// Coda circolare senza lock tra un solo produttore (lo scanner) e un solo
+// consumatore (il loop del registro). N deve essere una potenza di due.
+// Quando è piena le nuove rilevazioni vengono scartate e contate.
+template<size_t N> class SightingRing {
+  static_assert((N & (N - 1)) == 0, "N deve essere una potenza di due");
+
+ public:
+  // Lato produttore
+  bool push(const Sighting &sighting) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    if (head - tail >= N) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    slots_[head & (N - 1)] = sighting;
+    head_.store(head + 1, std::memory_order_release);
+    pushed_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Lato consumatore: copia fino a max rilevazioni in out, restituisce quante
+  size_t pop(Sighting *out, size_t max) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t count = head - tail;
+    if (count > peak_depth_) {
+      peak_depth_ = count;
+    }
+    if (count > max) {
+      count = max;
+    }
+    for (size_t i = 0; i < count; i++) {
+      out[i] = slots_[(tail + i) & (N - 1)];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  uint32_t get_pushed() const { return pushed_.load(std::memory_order_relaxed); }
+  uint32_t get_dropped() const { return dropped_.load(std::memory_order_relaxed); }
+  // Massimo numero di rilevazioni in attesa osservato dal consumatore
+  size_t get_peak_depth() const { return peak_depth_; }
+
+ private:
+  Sighting slots_[N];
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+  std::atomic<uint32_t> pushed_{0};
+  std::atomic<uint32_t> dropped_{0};
+  size_t peak_depth_ = 0;
+};
+
+// Filtro delle rilevazioni ripetute: un MAC viene applicato al registro al
+// massimo una volta per finestra, a meno che porti un token a codice
+// variabile con un contatore nuovo. Ricorda i MAC recenti in una piccola
+// tabella a dimensione fissa (sostituendo il più vecchio).
+class SightingDeduplicator {
+ public:
+  static const size_t SLOTS = 32;
+
+  void set_window(uint32_t window_ms) { window_ms_ = window_ms; }
+
+  // true se la rilevazione va applicata, false se è un duplicato
+  bool accept(const Sighting &sighting) {
+    Slot *oldest = &slots_[0];
+    for (auto &slot : slots_) {
+      if (slot.used && slot.mac == sighting.mac) {
+        bool new_token = sighting.has_token && sighting.token.counter != slot.counter;
+        if (!new_token && sighting.timestamp_ms - slot.applied_ms < window_ms_) {
+          return false;
+        }
+        slot.applied_ms = sighting.timestamp_ms;
+        if (sighting.has_token) {
+          slot.counter = sighting.token.counter;
+        }
+        return true;
+      }
+      if (!slot.used) {
+        oldest = &slot;
+      } else if (oldest->used && slot.applied_ms - oldest->applied_ms > 0x80000000u) {
+        oldest = &slot; // slot.applied_ms precede oldest->applied_ms
+      }
+    }
+    oldest->used = true;
+    oldest->mac = sighting.mac;
+    oldest->applied_ms = sighting.timestamp_ms;
+    oldest->counter = sighting.has_token ? sighting.token.counter : 0;
+    return true;
+  }
+
+ private:
+  struct Slot {
+    uint64_t mac = 0;
+    uint32_t applied_ms = 0;
+    uint32_t counter = 0; // Contatore dell'ultimo token applicato
+    bool used = false;
+  };
+
+  Slot slots_[SLOTS];
+  uint32_t window_ms_ = 1000;
+};
+
+} // namespace esphome
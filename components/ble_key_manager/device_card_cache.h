@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace esphome {
+
+// Cache delle schede dispositivo già generate per la pagina principale.
+// Ogni scheda è salvata senza le parti che cambiano nel tempo (scadenza,
+// ultima rilevazione), di cui sono ricordate le posizioni. La chiave è il
+// MAC con la revisione del record e lo stato di autorizzazione: ogni
+// modifica del registro incrementa la revisione e rende la voce non più
+// valida. Oltre la capienza in byte vengono scartate le voci usate meno di
+// recente, ma mai quelle già usate dalla pagina in corso: se una pagina non
+// sta tutta in cache ne resta in cache la parte iniziale, invece di
+// scartare ad ogni scheda quella che servirà per prima alla pagina dopo.
+class DeviceCardCache {
+ public:
+  struct Fragment {
+    std::string html;
+    size_t expiry_slot = 0; // Posizione del testo di scadenza
+    size_t seen_slot = 0;   // Posizione del paragrafo dell'ultima rilevazione
+  };
+
+  // Memoria massima occupata dalle schede (0 = cache disattivata)
+  void set_capacity(size_t bytes) {
+    capacity_ = bytes;
+    evict_(0, tick_);
+  }
+
+  // Inizio della generazione di una pagina
+  void begin_page() { page_start_ = tick_; }
+
+  // Scheda valida per il dispositivo, nullptr se assente o non aggiornata
+  const Fragment *find(const std::string &mac, uint32_t revision, bool authorized) {
+    auto it = entries_.find(mac);
+    if (it == entries_.end() || it->second.revision != revision || it->second.authorized != authorized) {
+      misses_++;
+      return nullptr;
+    }
+    it->second.last_used = ++tick_;
+    hits_++;
+    return &it->second.fragment;
+  }
+
+  // Salva una scheda; nullptr (senza usare fragment) se non c'è spazio
+  const Fragment *store(const std::string &mac, uint32_t revision, bool authorized, Fragment &&fragment) {
+    size_t size = entry_size_(mac, fragment);
+    if (size > capacity_) {
+      return nullptr;
+    }
+    auto it = entries_.find(mac);
+    if (it != entries_.end()) {
+      used_ -= entry_size_(mac, it->second.fragment);
+      entries_.erase(it);
+    }
+    if (!evict_(size, page_start_)) {
+      return nullptr;
+    }
+
+    Entry &entry = entries_[mac];
+    entry.fragment = std::move(fragment);
+    entry.revision = revision;
+    entry.authorized = authorized;
+    entry.last_used = ++tick_;
+    used_ += size;
+    return &entry.fragment;
+  }
+
+  uint32_t get_hits() const { return hits_; }
+  uint32_t get_misses() const { return misses_; }
+  uint32_t get_evictions() const { return evictions_; }
+  size_t get_used() const { return used_; }
+  size_t get_entries() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    Fragment fragment;
+    uint32_t revision = 0;
+    uint32_t last_used = 0;
+    bool authorized = false;
+  };
+
+  // Stima della memoria di una voce, compreso il nodo della mappa
+  static size_t entry_size_(const std::string &mac, const Fragment &fragment) {
+    return fragment.html.size() + mac.size() + sizeof(Entry) + 32;
+  }
+
+  // Libera spazio per una voce di size byte scartando solo voci usate
+  // l'ultima volta non dopo protect_after; false se non è possibile
+  bool evict_(size_t size, uint32_t protect_after) {
+    while (!entries_.empty() && used_ + size > capacity_) {
+      auto oldest = entries_.begin();
+      for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->second.last_used < oldest->second.last_used) {
+          oldest = it;
+        }
+      }
+      if (oldest->second.last_used > protect_after) {
+        return false;
+      }
+      used_ -= entry_size_(oldest->first, oldest->second.fragment);
+      entries_.erase(oldest);
+      evictions_++;
+    }
+    return used_ + size <= capacity_;
+  }
+
+  std::map<std::string, Entry> entries_;
+  size_t capacity_ = 16384;
+  size_t used_ = 0;
+  uint32_t tick_ = 0;
+  uint32_t page_start_ = 0;
+  uint32_t hits_ = 0;
+  uint32_t misses_ = 0;
+  uint32_t evictions_ = 0;
+};
+
+} // namespace esphome
@@ -0,0 +1,451 @@
+#pragma once
+
+#include "esphome.h"
+#include "ble_device_manager.h"
+#include "device_card_cache.h"
+#include <cstdarg>
+#include <mutex>
+#include <string>
+
+namespace esphome {
+
+// Filtri e paginazione della pagina dei dispositivi
+struct DevicePageQuery {
+  static const uint32_t DEFAULT_LIMIT = 50;
+  static const uint32_t MAX_LIMIT = 100;
+
+  uint32_t offset = 0;
+  uint32_t limit = DEFAULT_LIMIT;
+  int8_t authorized = -1;   // -1 = tutti, 0 = solo non autorizzati, 1 = solo autorizzati
+  uint32_t seen_within = 0; // 0 = nessun filtro, altrimenti secondi dall'ultima rilevazione
+  std::string name_prefix;
+};
+
+// Genera la pagina principale un pezzo alla volta per una risposta chunked.
+// I dispositivi vengono letti dal registro tramite un cursore solo quando il
+// buffer TCP ha spazio, quindi la memoria usata non dipende dal numero di
+// dispositivi registrati: al massimo una scheda dispositivo alla volta.
+// Le schede dei dispositivi non modificati vengono prese dalla cache, se
+// presente, e completate solo con scadenza e ultima rilevazione.
+class DevicePageStream {
+ public:
+  DevicePageStream(BLEDeviceManager *device_manager, const DevicePageQuery &query,
+                   DeviceCardCache *card_cache = nullptr)
+      : device_manager_(device_manager), query_(query), card_cache_(card_cache) {
+    pending_.reserve(1024);
+    if (card_cache_ != nullptr) {
+      card_cache_->begin_page();
+    }
+  }
+
+  // Riempie il buffer con il prossimo pezzo di pagina; 0 indica la fine
+  size_t fill(uint8_t *buffer, size_t max_len) {
+    std::lock_guard<std::recursive_mutex> lock(device_manager_->get_mutex());
+    size_t written = 0;
+    while (written < max_len) {
+      if (pending_pos_ >= pending_.size()) {
+        pending_.clear();
+        pending_pos_ = 0;
+        if (!render_next_()) {
+          break;
+        }
+        continue;
+      }
+      size_t len = pending_.size() - pending_pos_;
+      if (len > max_len - written) {
+        len = max_len - written;
+      }
+      memcpy(buffer + written, pending_.data() + pending_pos_, len);
+      pending_pos_ += len;
+      written += len;
+    }
+    return written;
+  }
+
+ private:
+  enum Stage { STAGE_HEADER, STAGE_FILTERS, STAGE_DEVICES, STAGE_PAGER, STAGE_FOOTER, STAGE_DONE };
+
+  BLEDeviceManager *device_manager_;
+  DevicePageQuery query_;
+  DeviceCardCache *card_cache_;
+  Stage stage_ = STAGE_HEADER;
+
+  // Testo generato ma non ancora inviato
+  std::string pending_;
+  size_t pending_pos_ = 0;
+
+  // Cursore sul registro
+  size_t cursor_ = 0;
+  std::string cursor_mac_; // MAC dell'ultimo dispositivo letto, per riallinearsi dopo modifiche
+  uint32_t matched_ = 0;   // Dispositivi che soddisfano i filtri visti finora
+  uint32_t rendered_ = 0;  // Dispositivi mostrati in questa pagina
+  bool has_more_ = false;
+
+  // Genera il prossimo pezzo di pagina; false se la pagina è completa
+  bool render_next_() {
+    switch (stage_) {
+      case STAGE_HEADER:
+        render_header_();
+        stage_ = STAGE_FILTERS;
+        return true;
+      case STAGE_FILTERS:
+        render_filters_();
+        stage_ = STAGE_DEVICES;
+        return true;
+      case STAGE_DEVICES: {
+        const BLEDeviceManager::BLEDevice *device = next_match_();
+        if (device != nullptr && rendered_ < query_.limit) {
+          render_device_(*device);
+          rendered_++;
+          return true;
+        }
+        has_more_ = (device != nullptr);
+        if (rendered_ == 0) {
+          append_("<p>Nessun dispositivo registrato.</p>");
+        }
+        stage_ = STAGE_PAGER;
+        return true;
+      }
+      case STAGE_PAGER:
+        render_pager_();
+        stage_ = STAGE_FOOTER;
+        return true;
+      case STAGE_FOOTER:
+        render_footer_();
+        stage_ = STAGE_DONE;
+        return true;
+      case STAGE_DONE:
+      default:
+        return false;
+    }
+  }
+
+  // Avanza il cursore fino al prossimo dispositivo che soddisfa i filtri
+  // e che cade dopo l'offset richiesto
+  const BLEDeviceManager::BLEDevice *next_match_() {
+    // Se il registro è cambiato tra due pezzi, riallinea il cursore
+    // sull'ultimo dispositivo letto
+    if (cursor_ > 0) {
+      const BLEDeviceManager::BLEDevice *last = device_manager_->get_device_at(cursor_ - 1);
+      if (last == nullptr || last->mac_address != cursor_mac_) {
+        size_t count = device_manager_->get_device_count();
+        for (size_t i = 0; i < count; i++) {
+          if (device_manager_->get_device_at(i)->mac_address == cursor_mac_) {
+            cursor_ = i + 1;
+            break;
+          }
+        }
+      }
+    }
+
+    const BLEDeviceManager::BLEDevice *device;
+    while ((device = device_manager_->get_device_at(cursor_)) != nullptr) {
+      cursor_++;
+      cursor_mac_ = device->mac_address;
+      if (!matches_(*device)) {
+        continue;
+      }
+      if (matched_++ < query_.offset) {
+        continue;
+      }
+      return device;
+    }
+    return nullptr;
+  }
+
+  bool matches_(const BLEDeviceManager::BLEDevice &device) {
+    if (query_.authorized >= 0 &&
+        BLEDeviceManager::is_authorized(device, millis() / 1000) != (query_.authorized == 1)) {
+      return false;
+    }
+    if (query_.seen_within > 0) {
+      uint32_t current_time = millis() / 1000;
+      if (device.last_seen == 0 || current_time - device.last_seen > query_.seen_within) {
+        return false;
+      }
+    }
+    if (!query_.name_prefix.empty() && device.name.compare(0, query_.name_prefix.size(), query_.name_prefix) != 0) {
+      return false;
+    }
+    return true;
+  }
+
+  void render_header_() {
+    append_("<!DOCTYPE html><html><head>");
+    append_("<meta charset=\"UTF-8\">");
+    append_("<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">");
+    append_("<title>BLE Key Manager</title>");
+    append_("<style>");
+    append_("body{font-family:Arial,sans-serif;margin:0;padding:20px;line-height:1.6;}");
+    append_("h1{color:#333;}");
+    append_(".container{max-width:1200px;margin:0 auto;}");
+    append_(".card{background:#f9f9f9;border-radius:5px;padding:15px;margin-bottom:15px;box-shadow:0 2px 4px rgba(0,0,0,0.1);}");
+    append_(".device{display:flex;justify-content:space-between;align-items:center;}");
+    append_(".device-info{flex:1;}");
+    append_(".device-actions{display:flex;gap:10px;}");
+    append_("button{background:#4CAF50;color:white;border:none;padding:8px 12px;border-radius:4px;cursor:pointer;}");
+    append_("button.revoke{background:#f44336;}");
+    append_("button.edit{background:#2196F3;}");
+    append_(".add-form{margin-top:20px;}");
+    append_("input,select{padding:8px;margin-right:10px;border-radius:4px;border:1px solid #ddd;}");
+    append_(".authorized{color:green;font-weight:bold;}");
+    append_(".unauthorized{color:red;}");
+    append_(".pager{display:flex;gap:10px;margin-bottom:15px;}");
+    append_("</style>");
+    append_("</head><body>");
+    append_("<div class=\"container\">");
+    append_("<h1>BLE Key Manager</h1>");
+  }
+
+  void render_filters_() {
+    // Sezione dispositivi
+    append_("<h2>Dispositivi BLE</h2>");
+
+    // Form per filtrare l'elenco
+    append_("<form class=\"card\" action=\"/\" method=\"get\">");
+    append_("<input type=\"text\" name=\"prefix\" placeholder=\"Nome inizia con\" value=\"");
+    append_escaped_(query_.name_prefix);
+    append_("\">");
+    append_("<select name=\"authorized\">");
+    appendf_("<option value=\"\"%s>Tutti</option>", query_.authorized < 0 ? " selected" : "");
+    appendf_("<option value=\"1\"%s>Autorizzati</option>", query_.authorized == 1 ? " selected" : "");
+    appendf_("<option value=\"0\"%s>Non autorizzati</option>", query_.authorized == 0 ? " selected" : "");
+    append_("</select>");
+    append_("<select name=\"recent\">");
+    appendf_("<option value=\"\"%s>Qualsiasi rilevazione</option>", query_.seen_within == 0 ? " selected" : "");
+    appendf_("<option value=\"60\"%s>Visti nell'ultimo minuto</option>", query_.seen_within == 60 ? " selected" : "");
+    appendf_("<option value=\"300\"%s>Visti negli ultimi 5 minuti</option>", query_.seen_within == 300 ? " selected" : "");
+    appendf_("<option value=\"3600\"%s>Visti nell'ultima ora</option>", query_.seen_within == 3600 ? " selected" : "");
+    append_("</select>");
+    append_("<button type=\"submit\">Filtra</button>");
+    append_("</form>");
+  }
+
+  void render_device_(const BLEDeviceManager::BLEDevice &device) {
+    bool authorized = BLEDeviceManager::is_authorized(device, millis() / 1000);
+    const DeviceCardCache::Fragment *fragment = nullptr;
+    if (card_cache_ != nullptr) {
+      fragment = card_cache_->find(device.mac_address, device.revision, authorized);
+    }
+
+    DeviceCardCache::Fragment rendered;
+    if (fragment == nullptr) {
+      render_card_(device, authorized, &rendered);
+      if (card_cache_ != nullptr) {
+        fragment = card_cache_->store(device.mac_address, device.revision, authorized, std::move(rendered));
+      }
+      if (fragment == nullptr) {
+        fragment = &rendered;
+      }
+    }
+
+    // Parti fisse della scheda con le parti variabili inserite
+    const std::string &html = fragment->html;
+    pending_.append(html, 0, fragment->expiry_slot);
+    if (authorized && device.expiry_time > 0) {
+      render_expiry_(device);
+    }
+    pending_.append(html, fragment->expiry_slot, fragment->seen_slot - fragment->expiry_slot);
+    render_seen_(device);
+    pending_.append(html, fragment->seen_slot, std::string::npos);
+  }
+
+  // Genera le parti fisse di una scheda dispositivo
+  void render_card_(const BLEDeviceManager::BLEDevice &device, bool authorized, DeviceCardCache::Fragment *fragment) {
+    size_t base = pending_.size();
+    append_("<div class=\"card\"><div class=\"device\">");
+
+    // Informazioni dispositivo
+    append_("<div class=\"device-info\">");
+    append_("<h3>");
+    append_escaped_(device.name);
+    append_("</h3><p>MAC: ");
+    append_escaped_(device.mac_address);
+    append_("</p>");
+
+    // Stato autorizzazione (la scadenza viene inserita ad ogni invio)
+    if (authorized) {
+      append_("<p class=\"authorized\">Autorizzato");
+      fragment->expiry_slot = pending_.size() - base;
+      append_("</p>");
+    } else {
+      append_("<p class=\"unauthorized\">Non autorizzato</p>");
+      fragment->expiry_slot = pending_.size() - base;
+    }
+
+    // Azione associata
+    if (!device.action_id.empty()) {
+      append_("<p>Azione: ");
+      append_escaped_(device.action_id);
+      append_("</p>");
+    } else {
+      append_("<p>Nessuna azione definita</p>");
+    }
+
+    // Ultima rilevazione (inserita ad ogni invio)
+    fragment->seen_slot = pending_.size() - base;
+
+    append_("</div>");
+
+    // Azioni dispositivo
+    append_("<div class=\"device-actions\">");
+
+    // Pulsante autorizza/revoca. Il MAC finisce in una stringa JavaScript
+    // dentro un attributo: viene codificato come parametro di URL, così non
+    // può contenere né virgolette né apici.
+    std::string encoded_mac;
+    url_encode_(device.mac_address, &encoded_mac);
+    const char *mac = encoded_mac.c_str();
+    if (authorized) {
+      appendf_("<button class=\"revoke\" onclick=\"window.location.href='/revoke?mac=%s';\">Revoca</button>", mac);
+    } else {
+      appendf_("<button onclick=\"window.location.href='/authorize?mac=%s';\">Autorizza</button>", mac);
+      appendf_("<button onclick=\"window.location.href='/authorize_temp?mac=%s';\">Autorizza (24h)</button>", mac);
+    }
+
+    // Pulsante modifica
+    appendf_("<button class=\"edit\" onclick=\"window.location.href='/edit?mac=%s';\">Modifica</button>", mac);
+
+    // Pulsante elimina
+    appendf_("<button class=\"revoke\" onclick=\"if(confirm('Sei sicuro di voler eliminare questo dispositivo?')) "
+             "window.location.href='/delete?mac=%s';\">Elimina</button>", mac);
+
+    append_("</div></div></div>");
+
+    fragment->html.assign(pending_, base, std::string::npos);
+    pending_.resize(base);
+  }
+
+  // Tempo rimanente di un'autorizzazione temporanea
+  void render_expiry_(const BLEDeviceManager::BLEDevice &device) {
+    uint32_t current_time = millis() / 1000;
+    uint32_t remaining = (device.expiry_time > current_time) ?
+                         (device.expiry_time - current_time) : 0;
+
+    uint32_t hours = remaining / 3600;
+    uint32_t minutes = (remaining % 3600) / 60;
+    uint32_t seconds = remaining % 60;
+
+    appendf_(" (scade tra %02u:%02u:%02u)", hours, minutes, seconds);
+  }
+
+  // Ultima rilevazione
+  void render_seen_(const BLEDeviceManager::BLEDevice &device) {
+    if (device.last_seen > 0) {
+      uint32_t current_time = millis() / 1000;
+      uint32_t seconds_ago = current_time - device.last_seen;
+
+      if (seconds_ago < 60) {
+        appendf_("<p>Rilevato %u secondi fa (RSSI: %d dBm)</p>", seconds_ago, device.last_rssi);
+      } else if (seconds_ago < 3600) {
+        appendf_("<p>Rilevato %u minuti fa (RSSI: %d dBm)</p>", seconds_ago / 60, device.last_rssi);
+      } else {
+        appendf_("<p>Rilevato %u ore fa (RSSI: %d dBm)</p>", seconds_ago / 3600, device.last_rssi);
+      }
+    } else {
+      append_("<p>Mai rilevato</p>");
+    }
+  }
+
+  void render_pager_() {
+    if (query_.offset == 0 && !has_more_) {
+      return;
+    }
+
+    append_("<div class=\"pager\">");
+    if (query_.offset > 0) {
+      uint32_t previous = query_.offset > query_.limit ? query_.offset - query_.limit : 0;
+      append_page_link_(previous, "&laquo; Precedenti");
+    }
+    if (has_more_) {
+      append_page_link_(query_.offset + query_.limit, "Successivi &raquo;");
+    }
+    append_("</div>");
+  }
+
+  void render_footer_() {
+    // Form per aggiungere un nuovo dispositivo
+    append_("<div class=\"add-form\"><h2>Aggiungi Dispositivo</h2>");
+    append_("<form action=\"/add\" method=\"get\">");
+    append_("<input type=\"text\" name=\"mac\" placeholder=\"Indirizzo MAC (XX:XX:XX:XX:XX:XX)\" required>");
+    append_("<input type=\"text\" name=\"name\" placeholder=\"Nome dispositivo\" required>");
+    append_("<select name=\"action\">");
+    append_("<option value=\"\">Nessuna azione</option>");
+    append_("<option value=\"toggle_relay\">Toggle Relè</option>");
+    append_("<option value=\"turn_on_relay\">Accendi Relè</option>");
+    append_("<option value=\"turn_off_relay\">Spegni Relè</option>");
+    append_("</select>");
+    append_("<button type=\"submit\">Aggiungi</button>");
+    append_("</form></div>");
+
+    append_("<p><a href=\"/logout\">Esci</a></p>");
+    append_("</div></body></html>");
+  }
+
+  // Link ad un'altra pagina mantenendo i filtri correnti
+  void append_page_link_(uint32_t offset, const char *label) {
+    appendf_("<a href=\"/?offset=%u&limit=%u", offset, query_.limit);
+    if (query_.authorized >= 0) {
+      appendf_("&authorized=%d", query_.authorized);
+    }
+    if (query_.seen_within > 0) {
+      appendf_("&recent=%u", query_.seen_within);
+    }
+    if (!query_.name_prefix.empty()) {
+      append_("&prefix=");
+      url_encode_(query_.name_prefix, &pending_);
+    }
+    appendf_("\">%s</a>", label);
+  }
+
+  // Valore di un parametro di URL: restano solo lettere, cifre e -_.
+  static void url_encode_(const std::string &text, std::string *out) {
+    static const char HEX[] = "0123456789ABCDEF";
+    for (char c : text) {
+      unsigned char u = static_cast<unsigned char>(c);
+      if (isalnum(u) || c == '-' || c == '_' || c == '.') {
+        out->push_back(c);
+      } else {
+        out->push_back('%');
+        out->push_back(HEX[u >> 4]);
+        out->push_back(HEX[u & 0x0F]);
+      }
+    }
+  }
+
+  void append_(const char *text) {
+    pending_.append(text);
+  }
+
+  void appendf_(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    if (len > 0) {
+      size_t start = pending_.size();
+      pending_.resize(start + len + 1);
+      vsnprintf(&pending_[start], len + 1, format, args);
+      pending_.resize(start + len);
+    }
+    va_end(args);
+  }
+
+  // Testo inserito nella pagina o in un attributo HTML
+  void append_escaped_(const std::string &text) {
+    for (char c : text) {
+      switch (c) {
+        case '"': append_("&quot;"); break;
+        case '\'': append_("&#39;"); break;
+        case '&': append_("&amp;"); break;
+        case '<': append_("&lt;"); break;
+        case '>': append_("&gt;"); break;
+        default: pending_.push_back(c); break;
+      }
+    }
+  }
+};
+
+} // namespace esphome
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "journal_store.h"
+
+#ifdef USE_ESP32
+#include <esp_partition.h>
+
+namespace esphome {
+
+// Memoria del giornale su una partizione dati della flash dell'ESP32
+class ESP32PartitionFlash : public FlashDevice {
+ public:
+  static const size_t SECTOR_SIZE = 4096;
+
+  explicit ESP32PartitionFlash(const esp_partition_t *partition) : partition_(partition) {}
+
+  // Cerca la partizione dati con il nome indicato (nullptr se assente)
+  static ESP32PartitionFlash *open(const char *name) {
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (partition == nullptr || partition->size < 2 * SECTOR_SIZE) {
+      return nullptr;
+    }
+    return new ESP32PartitionFlash(partition);
+  }
+
+  size_t sector_size() const override { return SECTOR_SIZE; }
+  size_t sector_count() const override { return partition_->size / SECTOR_SIZE; }
+
+  bool read(size_t address, void *data, size_t len) override {
+    return esp_partition_read(partition_, address, data, len) == ESP_OK;
+  }
+
+  bool write(size_t address, const void *data, size_t len) override {
+    return esp_partition_write(partition_, address, data, len) == ESP_OK;
+  }
+
+  bool erase_sector(size_t sector) override {
+    return esp_partition_erase_range(partition_, sector * SECTOR_SIZE, SECTOR_SIZE) == ESP_OK;
+  }
+
+ private:
+  const esp_partition_t *partition_;
+};
+
+} // namespace esphome
+
+#endif
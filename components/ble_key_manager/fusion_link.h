@@ -0,0 +1,158 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace esphome {
+
+// Trasporto UDP dei pacchetti di rilevazioni tra i nodi. Usa solo socket
+// BSD non bloccanti, disponibili sia su ESP32 (lwIP) sia su Linux, così un
+// nodo può essere eseguito anche come processo su un PC. Vengono accettati
+// solo i pacchetti che arrivano dall'indirizzo e dalla porta di un nodo
+// configurato: ogni nodo invia dal socket su cui riceve.
+class FusionLink {
+ public:
+  static const size_t MAX_PACKET_SIZE = 1472;
+
+  ~FusionLink() {
+    if (socket_ >= 0) {
+      ::close(socket_);
+    }
+  }
+
+  // Apre il socket in ascolto sulla porta indicata
+  bool open(uint16_t port) {
+    socket_ = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket_ < 0) {
+      return false;
+    }
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (::bind(socket_, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0 ||
+        ::fcntl(socket_, F_SETFL, ::fcntl(socket_, F_GETFL, 0) | O_NONBLOCK) < 0) {
+      ::close(socket_);
+      socket_ = -1;
+      return false;
+    }
+    port_ = port;
+    return true;
+  }
+
+  bool is_open() const { return socket_ >= 0; }
+
+  // Aggiunge un nodo come "indirizzo IPv4" o "indirizzo IPv4:porta" (senza
+  // porta vale la propria); false se l'indirizzo non è valido
+  bool add_peer(const std::string &peer) {
+    struct sockaddr_in address = {};
+    if (!parse_peer(peer, port_, &address)) {
+      return false;
+    }
+    peers_.push_back(address);
+    return true;
+  }
+
+  static bool parse_peer(const std::string &peer, uint16_t default_port, struct sockaddr_in *address) {
+    std::string host = peer;
+    uint32_t port = default_port;
+    size_t colon = peer.find(':');
+    if (colon != std::string::npos) {
+      host = peer.substr(0, colon);
+      const char *digits = peer.c_str() + colon + 1;
+      char *end;
+      if (*digits < '0' || *digits > '9') {
+        return false;
+      }
+      unsigned long value = strtoul(digits, &end, 10);
+      if (*end != '\0' || value == 0 || value > 65535) {
+        return false;
+      }
+      port = value;
+    }
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    return ::inet_pton(AF_INET, host.c_str(), &address->sin_addr) == 1;
+  }
+
+  size_t get_peer_count() const { return peers_.size(); }
+
+  // Invia un pacchetto a tutti i nodi
+  void send(const std::string &packet) {
+    if (socket_ < 0) {
+      return;
+    }
+    for (const auto &peer : peers_) {
+      if (::sendto(socket_, packet.data(), packet.size(), 0, reinterpret_cast<const struct sockaddr *>(&peer),
+                   sizeof(peer)) == static_cast<ssize_t>(packet.size())) {
+        packets_sent_++;
+        bytes_sent_ += packet.size();
+      } else {
+        send_errors_++;
+      }
+    }
+  }
+
+  // Legge fino a max_packets pacchetti in attesa chiamando
+  // callback(const uint8_t *data, size_t len, size_t peer) per ognuno, con
+  // l'indice del nodo mittente; quelli da altri mittenti vengono scartati
+  template<typename F> size_t poll(F callback, size_t max_packets) {
+    if (socket_ < 0) {
+      return 0;
+    }
+    uint8_t buffer[MAX_PACKET_SIZE];
+    size_t received = 0;
+    while (received < max_packets) {
+      struct sockaddr_in source = {};
+      socklen_t source_len = sizeof(source);
+      ssize_t len = ::recvfrom(socket_, buffer, sizeof(buffer), 0, reinterpret_cast<struct sockaddr *>(&source),
+                               &source_len);
+      if (len <= 0) {
+        break;
+      }
+      received++;
+      size_t peer = find_peer_(source);
+      if (peer == peers_.size()) {
+        unknown_sources_++;
+        continue;
+      }
+      packets_received_++;
+      callback(buffer, static_cast<size_t>(len), peer);
+    }
+    return received;
+  }
+
+  uint32_t get_packets_sent() const { return packets_sent_; }
+  uint32_t get_bytes_sent() const { return bytes_sent_; }
+  uint32_t get_send_errors() const { return send_errors_; }
+  uint32_t get_packets_received() const { return packets_received_; }
+  uint32_t get_unknown_sources() const { return unknown_sources_; }
+
+ private:
+  int socket_ = -1;
+  uint16_t port_ = 0;
+  std::vector<struct sockaddr_in> peers_;
+  uint32_t packets_sent_ = 0;
+  uint32_t bytes_sent_ = 0;
+  uint32_t send_errors_ = 0;
+  uint32_t packets_received_ = 0;
+  uint32_t unknown_sources_ = 0;
+
+  size_t find_peer_(const struct sockaddr_in &source) const {
+    for (size_t i = 0; i < peers_.size(); i++) {
+      if (peers_[i].sin_addr.s_addr == source.sin_addr.s_addr && peers_[i].sin_port == source.sin_port) {
+        return i;
+      }
+    }
+    return peers_.size();
+  }
+};
+
+} // namespace esphome
@@ -0,0 +1,517 @@
+#pragma once
+
+#include "registry_codec.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace esphome {
+
+// Accesso alla memoria flash a settori. Come sulla flash reale, write() può
+// solo portare bit da 1 a 0: un'area va cancellata (tutti i byte a 0xFF)
+// prima di essere riscritta.
+class FlashDevice {
+ public:
+  virtual ~FlashDevice() {}
+  virtual size_t sector_size() const = 0;
+  virtual size_t sector_count() const = 0;
+  virtual bool read(size_t address, void *data, size_t len) = 0;
+  virtual bool write(size_t address, const void *data, size_t len) = 0;
+  virtual bool erase_sector(size_t sector) = 0;
+};
+
+// CRC-32 (polinomio IEEE, riflesso) calcolato a nibble per non usare tabelle
+inline uint32_t journal_crc32(const uint8_t *data, size_t len, uint32_t crc = 0) {
+  static const uint32_t NIBBLE_TABLE[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+      0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = NIBBLE_TABLE[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+    crc = NIBBLE_TABLE[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+  }
+  return ~crc;
+}
+
+// Tipi di record del giornale
+enum JournalRecordType : uint8_t {
+  JOURNAL_BOOT = 1,           // Primo record scritto dopo ogni avvio
+  JOURNAL_PUT = 2,            // Dispositivo aggiunto o aggiornato (record completo)
+  JOURNAL_EXPIRY = 3,         // Autorizzazione concessa, revocata o scaduta (MAC + scadenza)
+  JOURNAL_REMOVE = 4,         // Dispositivo eliminato (MAC)
+  JOURNAL_TXN_BEGIN = 5,      // Inizio di un gruppo di modifiche atomico
+  JOURNAL_TXN_END = 6,        // Fine del gruppo: senza questo record il gruppo viene scartato
+  JOURNAL_SNAPSHOT_BEGIN = 7, // Inizio di uno snapshot (generazione)
+  JOURNAL_SNAPSHOT_DEVICE = 8,// Dispositivo dello snapshot (record completo)
+  JOURNAL_SNAPSHOT_END = 9,   // Fine dello snapshot (generazione)
+  JOURNAL_ROLLING = 10,       // Chiave e ultimo contatore del codice variabile (MAC, chiave, contatore)
+  JOURNAL_CLOCK = 11,         // Tempo di funzionamento accumulato (orologio del giornale)
+  JOURNAL_TXN_ABORT = 12,     // Gruppo annullato: le modifiche dall'inizio del gruppo vengono scartate
+};
+
+// Modifica ricostruita dal giornale all'avvio
+struct JournalEntry {
+  JournalRecordType type;
+  RegistryRecord record; // Per EXPIRY e REMOVE sono significativi solo mac ed expires_in
+  std::string key;       // Per ROLLING (con mac)
+  uint32_t counter = 0;  // Per ROLLING il contatore, per CLOCK l'orologio del giornale
+};
+
+// Archivio del registro strutturato a log. Ogni modifica aggiunge un piccolo
+// record in coda al giornale, quindi il costo di scrittura non dipende dal
+// numero di dispositivi. Periodicamente viene scritto uno snapshot completo,
+// a piccoli passi, dopo il quale i settori più vecchi possono essere
+// riutilizzati.
+//
+// Formato: ogni settore inizia con un'intestazione (magic, sequenza, CRC);
+// ogni record ha lunghezza, tipo e CRC su intestazione e contenuto ed è
+// allineato a 4 byte. Un record troncato da un'interruzione di corrente non
+// supera il CRC e chiude la lettura del settore. Dopo ogni avvio la scrittura
+// riparte da un settore nuovo, così un settore interrotto non viene mai
+// ripreso a metà.
+//
+// All'avvio viene cercato l'ultimo snapshot completo e il giornale viene
+// riletto da lì in ordine: i record di snapshot e le modifiche successive
+// (anche quelle scritte mentre lo snapshot era in corso) ricostruiscono lo
+// stato. I gruppi di modifiche senza record di chiusura vengono ignorati.
+//
+// Le scadenze dei record (expires_in di PUT, EXPIRY e dispositivi dello
+// snapshot) non dipendono dall'archivio: chi scrive le esprime come istanti
+// di un orologio proprio del giornale, di cui append_clock() e
+// begin_snapshot() salvano il valore corrente. All'avvio i valori salvati
+// vengono restituiti come record CLOCK.
+class JournalStore {
+ public:
+  static const uint32_t SECTOR_MAGIC = 0x314A4B42; // "BKJ1"
+  static const size_t SECTOR_HEADER_SIZE = 12;
+  static const size_t RECORD_HEADER_SIZE = 8;
+  static const size_t MAX_PAYLOAD_SIZE = 256;
+
+  explicit JournalStore(FlashDevice *flash) : flash_(flash) {}
+
+  // Legge il giornale chiamando callback(const JournalEntry &) per ogni
+  // modifica da applicare, poi prepara la scrittura in un nuovo settore
+  template<typename F> bool load(F callback) {
+    size_t count = flash_->sector_count();
+    sector_seq_.assign(count, 0);
+    order_.clear();
+    max_seq_ = 0;
+
+    for (size_t i = 0; i < count; i++) {
+      uint8_t header[SECTOR_HEADER_SIZE];
+      if (!flash_->read(i * flash_->sector_size(), header, sizeof(header))) {
+        continue;
+      }
+      uint32_t magic = read_u32_(header);
+      uint32_t seq = read_u32_(header + 4);
+      if (magic != SECTOR_MAGIC || read_u32_(header + 8) != journal_crc32(header, 8) || seq == 0) {
+        continue;
+      }
+      sector_seq_[i] = seq;
+      order_.push_back(i);
+      max_seq_ = std::max(max_seq_, seq);
+    }
+    std::sort(order_.begin(), order_.end(),
+              [this](size_t a, size_t b) { return sector_seq_[a] < sector_seq_[b]; });
+
+    // Primo passaggio: ultimo snapshot completo e gruppi interrotti
+    Position snapshot_begin;
+    bool have_snapshot = false;
+    Position open_snapshot;
+    uint32_t open_generation = 0;
+    bool snapshot_open = false;
+    Position txn_begin;
+    bool txn_open = false;
+    aborted_txns_.clear();
+
+    scan_(Position{0, SECTOR_HEADER_SIZE}, [&](const Position &pos, uint8_t type, const uint8_t *payload, size_t len) {
+      switch (type) {
+        case JOURNAL_BOOT:
+          if (txn_open) aborted_txns_.push_back(txn_begin);
+          txn_open = false;
+          snapshot_open = false;
+          break;
+        case JOURNAL_TXN_BEGIN:
+          if (txn_open) aborted_txns_.push_back(txn_begin);
+          txn_begin = pos;
+          txn_open = true;
+          break;
+        case JOURNAL_TXN_END:
+          txn_open = false;
+          break;
+        case JOURNAL_TXN_ABORT:
+          if (txn_open) aborted_txns_.push_back(txn_begin);
+          txn_open = false;
+          break;
+        case JOURNAL_SNAPSHOT_BEGIN:
+          if (len == 4 || len == 8) {
+            open_snapshot = pos;
+            open_generation = read_u32_(payload);
+            snapshot_open = true;
+          }
+          break;
+        case JOURNAL_SNAPSHOT_END:
+          if (len == 4 && snapshot_open && read_u32_(payload) == open_generation) {
+            snapshot_begin = open_snapshot;
+            have_snapshot = true;
+            generation_ = open_generation;
+            snapshot_open = false;
+          }
+          break;
+      }
+      return true;
+    });
+    if (txn_open) {
+      aborted_txns_.push_back(txn_begin);
+    }
+
+    // Secondo passaggio: applica lo snapshot e le modifiche successive
+    Position start = have_snapshot ? snapshot_begin : Position{0, SECTOR_HEADER_SIZE};
+    bool in_snapshot = false;
+    bool skipping = false;
+    scan_(start, [&](const Position &pos, uint8_t type, const uint8_t *payload, size_t len) {
+      JournalEntry entry;
+      entry.type = static_cast<JournalRecordType>(type);
+      switch (type) {
+        case JOURNAL_BOOT:
+          skipping = false;
+          in_snapshot = false;
+          break;
+        case JOURNAL_TXN_BEGIN:
+          skipping = std::find(aborted_txns_.begin(), aborted_txns_.end(), pos) != aborted_txns_.end();
+          break;
+        case JOURNAL_TXN_END:
+        case JOURNAL_TXN_ABORT:
+          skipping = false;
+          break;
+        case JOURNAL_SNAPSHOT_BEGIN:
+          in_snapshot = have_snapshot && pos == snapshot_begin;
+          if (in_snapshot && len == 8) {
+            entry.type = JOURNAL_CLOCK;
+            entry.counter = read_u32_(payload + 4);
+            callback(entry);
+          }
+          break;
+        case JOURNAL_SNAPSHOT_END:
+          if (in_snapshot) {
+            in_snapshot = false;
+            return true;
+          }
+          break;
+        case JOURNAL_SNAPSHOT_DEVICE:
+          if (in_snapshot && decode_record_(payload, len, &entry.record)) {
+            entry.type = JOURNAL_PUT;
+            callback(entry);
+          }
+          break;
+        case JOURNAL_PUT:
+          if (!skipping && decode_record_(payload, len, &entry.record)) {
+            callback(entry);
+          }
+          break;
+        case JOURNAL_EXPIRY: {
+          size_t offset = 6;
+          if (!skipping && len > 6 && varint_decode(payload, len, &offset, &entry.record.expires_in)) {
+            memcpy(entry.record.mac, payload, 6);
+            callback(entry);
+          }
+          break;
+        }
+        case JOURNAL_REMOVE:
+          if (!skipping && len == 6) {
+            memcpy(entry.record.mac, payload, 6);
+            callback(entry);
+          }
+          break;
+        case JOURNAL_CLOCK: {
+          size_t offset = 0;
+          if (varint_decode(payload, len, &offset, &entry.counter) && offset == len) {
+            callback(entry);
+          }
+          break;
+        }
+        case JOURNAL_ROLLING: {
+          size_t offset = 7;
+          if (!skipping && len > 7 && payload[6] <= len - 7) {
+            offset += payload[6];
+            if (varint_decode(payload, len, &offset, &entry.counter) && offset == len) {
+              memcpy(entry.record.mac, payload, 6);
+              entry.key.assign(reinterpret_cast<const char *>(payload + 7), payload[6]);
+              callback(entry);
+            }
+          }
+          break;
+        }
+      }
+      return true;
+    });
+
+    // I settori precedenti lo snapshot non servono più
+    floor_seq_ = have_snapshot ? sector_seq_[order_[snapshot_begin.order]]
+                               : (order_.empty() ? max_seq_ + 1 : sector_seq_[order_.front()]);
+    release_old_sectors_();
+
+    // La scrittura riparte sempre da un settore nuovo
+    current_sector_ = order_.empty() ? count - 1 : order_.back();
+    write_offset_ = flash_->sector_size();
+    loaded_ = true;
+    return append_(JOURNAL_BOOT, nullptr, 0);
+  }
+
+  // Modifiche al registro
+  bool append_put(const RegistryRecord &record) {
+    return append_encoded_(JOURNAL_PUT, record);
+  }
+
+  bool append_expiry(const uint8_t *mac, uint32_t expires_in) {
+    uint8_t payload[6 + 5];
+    memcpy(payload, mac, 6);
+    size_t len = 6 + varint_encode(expires_in, payload + 6);
+    return append_(JOURNAL_EXPIRY, payload, len);
+  }
+
+  bool append_remove(const uint8_t *mac) {
+    return append_(JOURNAL_REMOVE, mac, 6);
+  }
+
+  bool append_rolling(const uint8_t *mac, const std::string &key, uint32_t counter) {
+    uint8_t payload[6 + 1 + 32 + 5];
+    if (key.size() > 32) {
+      return false;
+    }
+    memcpy(payload, mac, 6);
+    payload[6] = key.size();
+    memcpy(payload + 7, key.data(), key.size());
+    size_t len = 7 + key.size();
+    len += varint_encode(counter, payload + len);
+    return append_(JOURNAL_ROLLING, payload, len);
+  }
+
+  // Valore corrente dell'orologio del giornale
+  bool append_clock(uint32_t clock) {
+    uint8_t payload[5];
+    return append_(JOURNAL_CLOCK, payload, varint_encode(clock, payload));
+  }
+
+  bool begin_transaction() { return append_(JOURNAL_TXN_BEGIN, nullptr, 0); }
+  bool end_transaction() { return append_(JOURNAL_TXN_END, nullptr, 0); }
+  bool abort_transaction() { return append_(JOURNAL_TXN_ABORT, nullptr, 0); }
+
+  // Compattazione: indica se conviene scrivere un nuovo snapshot
+  // (oltre metà dei settori contiene dati ancora necessari)
+  bool needs_compaction() const {
+    return loaded_ && !snapshot_active_ && live_sectors_() * 2 > sector_seq_.size();
+  }
+
+  bool is_snapshot_active() const { return snapshot_active_; }
+
+  // Inizia uno snapshot; clock è l'orologio del giornale, che deve restare
+  // noto anche quando i settori con i record CLOCK precedenti vengono riusati
+  bool begin_snapshot(uint32_t clock) {
+    uint8_t payload[8];
+    write_u32_(payload, generation_ + 1);
+    write_u32_(payload + 4, clock);
+    if (!append_(JOURNAL_SNAPSHOT_BEGIN, payload, sizeof(payload))) {
+      return false;
+    }
+    generation_++;
+    snapshot_seq_ = sector_seq_[current_sector_];
+    snapshot_active_ = true;
+    return true;
+  }
+
+  bool append_snapshot_device(const RegistryRecord &record) {
+    return append_encoded_(JOURNAL_SNAPSHOT_DEVICE, record);
+  }
+
+  bool end_snapshot() {
+    uint8_t payload[4];
+    write_u32_(payload, generation_);
+    if (!append_(JOURNAL_SNAPSHOT_END, payload, sizeof(payload))) {
+      return false;
+    }
+    snapshot_active_ = false;
+    floor_seq_ = snapshot_seq_;
+    release_old_sectors_();
+    return true;
+  }
+
+  // Spazio occupato da un record con len byte di dati
+  static size_t record_size(size_t len) { return RECORD_HEADER_SIZE + align4_(len); }
+
+  // Settori necessari per scrivere bytes di record lunghi al massimo
+  // max_record byte partendo dal settore in corso, già in parte occupato:
+  // un record non viene mai diviso tra due settori
+  size_t sectors_for(size_t bytes, size_t max_record) const {
+    size_t usable = flash_->sector_size() - SECTOR_HEADER_SIZE;
+    usable = usable > max_record ? usable - max_record : 1;
+    return (bytes + usable - 1) / usable + 1;
+  }
+
+  // Settori che non contengono dati ancora necessari
+  size_t get_free_sectors() const { return sector_seq_.size() - live_sectors_(); }
+
+  // Statistiche di scrittura
+  uint32_t get_records_written() const { return records_written_; }
+  uint32_t get_bytes_written() const { return bytes_written_; }
+  uint32_t get_sectors_erased() const { return sectors_erased_; }
+  uint32_t get_write_errors() const { return write_errors_; }
+  size_t get_live_sectors() const { return live_sectors_(); }
+  size_t get_sector_count() const { return sector_seq_.size(); }
+
+ private:
+  // Posizione di un record: indice nell'ordine dei settori e offset
+  struct Position {
+    size_t order = 0;
+    size_t offset = 0;
+    bool operator==(const Position &other) const { return order == other.order && offset == other.offset; }
+  };
+
+  FlashDevice *flash_;
+  std::vector<uint32_t> sector_seq_; // Sequenza di ogni settore (0 = libero)
+  std::vector<size_t> order_;        // Settori validi in ordine di sequenza (solo durante load)
+  std::vector<Position> aborted_txns_;
+  uint32_t max_seq_ = 0;
+  uint32_t floor_seq_ = 0;           // Sequenza del settore più vecchio ancora necessario
+  uint32_t generation_ = 0;
+  uint32_t snapshot_seq_ = 0;
+  bool snapshot_active_ = false;
+  bool loaded_ = false;
+  size_t current_sector_ = 0;
+  size_t write_offset_ = 0;
+
+  uint32_t records_written_ = 0;
+  uint32_t bytes_written_ = 0;
+  uint32_t sectors_erased_ = 0;
+  uint32_t write_errors_ = 0;
+
+  static uint32_t read_u32_(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+  }
+
+  static void write_u32_(uint8_t *data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+  }
+
+  static size_t align4_(size_t len) { return (len + 3) & ~static_cast<size_t>(3); }
+
+  static bool decode_record_(const uint8_t *payload, size_t len, RegistryRecord *record) {
+    size_t consumed = 0;
+    return decode_binary_record(payload, len, record, &consumed) == REGISTRY_DECODE_OK && consumed == len;
+  }
+
+  size_t live_sectors_() const {
+    size_t live = 0;
+    for (uint32_t seq : sector_seq_) {
+      if (seq != 0 && seq >= floor_seq_) live++;
+    }
+    return live;
+  }
+
+  void release_old_sectors_() {
+    for (auto &seq : sector_seq_) {
+      if (seq < floor_seq_) seq = 0;
+    }
+  }
+
+  // Legge i record in ordine a partire da start; callback(pos, tipo, dati, lunghezza)
+  template<typename F> void scan_(Position start, F callback) {
+    uint8_t buffer[RECORD_HEADER_SIZE + MAX_PAYLOAD_SIZE];
+    size_t sector_size = flash_->sector_size();
+    for (size_t order = start.order; order < order_.size(); order++) {
+      size_t base = order_[order] * sector_size;
+      size_t offset = (order == start.order) ? start.offset : SECTOR_HEADER_SIZE;
+      while (offset + RECORD_HEADER_SIZE <= sector_size) {
+        if (!flash_->read(base + offset, buffer, RECORD_HEADER_SIZE)) break;
+        uint16_t len = buffer[0] | (buffer[1] << 8);
+        if (len == 0xFFFF || len > MAX_PAYLOAD_SIZE || offset + RECORD_HEADER_SIZE + len > sector_size) {
+          break; // Area cancellata o record non valido: fine del settore
+        }
+        if (len > 0 && !flash_->read(base + offset + RECORD_HEADER_SIZE, buffer + RECORD_HEADER_SIZE, len)) break;
+        uint32_t crc = journal_crc32(buffer, 4);
+        crc = journal_crc32(buffer + RECORD_HEADER_SIZE, len, crc);
+        if (crc != read_u32_(buffer + 4)) {
+          break; // Scrittura interrotta
+        }
+        if (!callback(Position{order, offset}, buffer[2], buffer + RECORD_HEADER_SIZE, len)) return;
+        offset += RECORD_HEADER_SIZE + align4_(len);
+      }
+    }
+  }
+
+  bool append_encoded_(JournalRecordType type, const RegistryRecord &record) {
+    std::string payload;
+    encode_binary_record(&payload, record);
+    return append_(type, reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+  }
+
+  bool append_(JournalRecordType type, const uint8_t *payload, size_t len) {
+    if (!loaded_ || len > MAX_PAYLOAD_SIZE) {
+      return false;
+    }
+    size_t size = RECORD_HEADER_SIZE + align4_(len);
+    if (write_offset_ + size > flash_->sector_size() && !open_next_sector_()) {
+      write_errors_++;
+      return false;
+    }
+
+    uint8_t buffer[RECORD_HEADER_SIZE + MAX_PAYLOAD_SIZE + 3];
+    memset(buffer, 0xFF, size);
+    buffer[0] = len & 0xFF;
+    buffer[1] = len >> 8;
+    buffer[2] = type;
+    buffer[3] = 0;
+    if (len > 0) {
+      memcpy(buffer + RECORD_HEADER_SIZE, payload, len);
+    }
+    uint32_t crc = journal_crc32(buffer, 4);
+    crc = journal_crc32(buffer + RECORD_HEADER_SIZE, len, crc);
+    write_u32_(buffer + 4, crc);
+
+    if (!flash_->write(current_sector_ * flash_->sector_size() + write_offset_, buffer, size)) {
+      // Il resto del settore non è più affidabile
+      write_offset_ = flash_->sector_size();
+      write_errors_++;
+      return false;
+    }
+    write_offset_ += size;
+    records_written_++;
+    bytes_written_ += size;
+    return true;
+  }
+
+  // Passa al settore successivo nell'anello, se non contiene dati necessari
+  bool open_next_sector_() {
+    size_t count = sector_seq_.size();
+    for (size_t attempt = 1; attempt <= count; attempt++) {
+      size_t next = (current_sector_ + attempt) % count;
+      if (sector_seq_[next] != 0 && sector_seq_[next] >= floor_seq_) {
+        return false; // Giornale pieno: serve una compattazione
+      }
+      uint8_t header[SECTOR_HEADER_SIZE];
+      write_u32_(header, SECTOR_MAGIC);
+      write_u32_(header + 4, max_seq_ + 1);
+      write_u32_(header + 8, journal_crc32(header, 8));
+      sectors_erased_++;
+      if (!flash_->erase_sector(next) || !flash_->write(next * flash_->sector_size(), header, sizeof(header))) {
+        // Settore difettoso: prova il successivo
+        sector_seq_[next] = 0;
+        continue;
+      }
+      max_seq_++;
+      sector_seq_[next] = max_seq_;
+      current_sector_ = next;
+      write_offset_ = SECTOR_HEADER_SIZE;
+      bytes_written_ += SECTOR_HEADER_SIZE;
+      return true;
+    }
+    return false;
+  }
+};
+
+} // namespace esphome
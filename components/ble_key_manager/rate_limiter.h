@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+
+// Secchiello di gettoni (token bucket) con aritmetica intera: i gettoni sono
+// espressi in millesimi per gestire ricariche di frazioni di gettone.
+struct TokenBucket {
+  uint32_t millitokens = 0;
+  uint32_t last_refill_ms = 0;
+
+  void reset(uint32_t burst, uint32_t now_ms) {
+    millitokens = burst * 1000;
+    last_refill_ms = now_ms;
+  }
+
+  void refill(uint32_t rate, uint32_t burst, uint32_t now_ms) {
+    uint32_t elapsed = now_ms - last_refill_ms;
+    last_refill_ms = now_ms;
+    uint64_t tokens = static_cast<uint64_t>(millitokens) + static_cast<uint64_t>(elapsed) * rate;
+    uint64_t cap = static_cast<uint64_t>(burst) * 1000;
+    millitokens = static_cast<uint32_t>(tokens > cap ? cap : tokens);
+  }
+
+  bool has(uint32_t cost) const { return millitokens >= cost * 1000; }
+  void take(uint32_t cost) { millitokens -= cost * 1000; }
+};
+
+// Limitatore delle richieste web: un secchiello per client (i client recenti
+// sono tenuti in una piccola tabella LRU per indirizzo IP), uno globale e un
+// limite alle risposte contemporaneamente in corso. Tutto lo stato ha
+// dimensione fissa.
+class RateLimiter {
+ public:
+  static const size_t CLIENT_SLOTS = 8;
+  static const size_t MAX_IN_FLIGHT = 16;
+
+  enum Result { ADMITTED, CLIENT_LIMITED, GLOBAL_LIMITED, BUSY };
+
+  // Gettoni al secondo e capienza massima dei secchielli
+  void set_client_rate(uint32_t rate, uint32_t burst) {
+    client_rate_ = rate;
+    client_burst_ = burst;
+  }
+  void set_global_rate(uint32_t rate, uint32_t burst) {
+    global_rate_ = rate;
+    global_burst_ = burst;
+  }
+  void set_max_in_flight(size_t max_in_flight) {
+    max_in_flight_ = max_in_flight > MAX_IN_FLIGHT ? MAX_IN_FLIGHT : max_in_flight;
+  }
+
+  // Decide se accettare una richiesta del client ip che costa cost gettoni.
+  // Se accettata, occupa uno slot di risposta identificato da key che va
+  // liberato con release(key) alla chiusura della richiesta.
+  Result admit(uint32_t ip, const void *key, uint32_t now_ms, uint32_t cost) {
+    if (!global_initialized_) {
+      global_.reset(global_burst_, now_ms);
+      global_initialized_ = true;
+    }
+    global_.refill(global_rate_, global_burst_, now_ms);
+
+    Client &client = find_client_(ip, now_ms);
+    client.bucket.refill(client_rate_, client_burst_, now_ms);
+    client.last_used_ms = now_ms;
+
+    if (!client.bucket.has(cost)) {
+      rejected_client_++;
+      return CLIENT_LIMITED;
+    }
+    if (!global_.has(cost)) {
+      rejected_global_++;
+      return GLOBAL_LIMITED;
+    }
+
+    const void **slot = nullptr;
+    for (size_t i = 0; i < max_in_flight_; i++) {
+      if (in_flight_[i] == nullptr) {
+        slot = &in_flight_[i];
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      rejected_busy_++;
+      return BUSY;
+    }
+
+    *slot = key;
+    client.bucket.take(cost);
+    global_.take(cost);
+    admitted_++;
+    in_flight_count_++;
+    if (in_flight_count_ > peak_in_flight_) {
+      peak_in_flight_ = in_flight_count_;
+    }
+    return ADMITTED;
+  }
+
+  // Libera lo slot di una richiesta accettata (nessun effetto altrimenti)
+  void release(const void *key) {
+    for (size_t i = 0; i < max_in_flight_; i++) {
+      if (in_flight_[i] == key) {
+        in_flight_[i] = nullptr;
+        in_flight_count_--;
+        return;
+      }
+    }
+  }
+
+  uint32_t get_admitted() const { return admitted_; }
+  uint32_t get_rejected_client() const { return rejected_client_; }
+  uint32_t get_rejected_global() const { return rejected_global_; }
+  uint32_t get_rejected_busy() const { return rejected_busy_; }
+  uint32_t get_client_evictions() const { return client_evictions_; }
+  uint32_t get_in_flight() const { return in_flight_count_; }
+  uint32_t get_peak_in_flight() const { return peak_in_flight_; }
+
+ private:
+  struct Client {
+    uint32_t ip = 0;
+    uint32_t last_used_ms = 0;
+    bool used = false;
+    TokenBucket bucket;
+  };
+
+  uint32_t client_rate_ = 2;
+  uint32_t client_burst_ = 10;
+  uint32_t global_rate_ = 8;
+  uint32_t global_burst_ = 30;
+  size_t max_in_flight_ = 4;
+
+  Client clients_[CLIENT_SLOTS];
+  TokenBucket global_;
+  bool global_initialized_ = false;
+  const void *in_flight_[MAX_IN_FLIGHT] = {};
+
+  uint32_t admitted_ = 0;
+  uint32_t rejected_client_ = 0;
+  uint32_t rejected_global_ = 0;
+  uint32_t rejected_busy_ = 0;
+  uint32_t client_evictions_ = 0;
+  uint32_t in_flight_count_ = 0;
+  uint32_t peak_in_flight_ = 0;
+
+  // Trova il client o ne sostituisce il meno usato di recente
+  Client &find_client_(uint32_t ip, uint32_t now_ms) {
+    Client *lru = &clients_[0];
+    for (auto &client : clients_) {
+      if (client.used && client.ip == ip) {
+        return client;
+      }
+      if (!client.used) {
+        lru = &client;
+      } else if (lru->used && now_ms - client.last_used_ms > now_ms - lru->last_used_ms) {
+        lru = &client;
+      }
+    }
+    if (lru->used) {
+      client_evictions_++;
+    }
+    lru->used = true;
+    lru->ip = ip;
+    lru->bucket.reset(client_burst_, now_ms);
+    return *lru;
+  }
+};
+
+} // namespace esphome
@@ -0,0 +1,406 @@
+#pragma once
+
+#include "rssi_history.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace esphome {
+
+// Lunghezze massime dei campi testuali di un dispositivo
+static const size_t REGISTRY_MAX_NAME_LENGTH = 64;
+static const size_t REGISTRY_MAX_ACTION_LENGTH = 64;
+
+// Numero massimo di dispositivi nel registro
+static const size_t REGISTRY_MAX_DEVICES = 500;
+
+// Durata massima di un'autorizzazione temporanea (10 anni, in secondi):
+// sommata al tempo dall'avvio non può superare i 32 bit
+static const uint32_t REGISTRY_MAX_DURATION = 10u * 365 * 24 * 3600;
+
+// Valori speciali del campo "scade tra" usato da import/export
+static const uint32_t REGISTRY_EXPIRES_NEVER = 0;   // Autorizzazione permanente
+static const uint32_t REGISTRY_EXPIRES_REVOKED = 1; // Autorizzazione revocata o scaduta
+
+// Record del registro in formato di scambio. La scadenza è espressa come
+// secondi mancanti perché i timestamp interni sono relativi all'avvio.
+struct RegistryRecord {
+  uint8_t mac[6] = {0};
+  std::string name;
+  std::string action_id;
+  uint32_t expires_in = REGISTRY_EXPIRES_NEVER;
+};
+
+// Converte un MAC testuale (con ':' o '-' come separatore, maiuscolo o
+// minuscolo) in 6 byte
+inline bool parse_mac(const std::string &text, uint8_t *mac) {
+  size_t pos = 0;
+  for (int i = 0; i < 6; i++) {
+    if (i > 0) {
+      if (pos >= text.size() || (text[pos] != ':' && text[pos] != '-')) return false;
+      pos++;
+    }
+    if (pos + 2 > text.size() || !isxdigit(static_cast<unsigned char>(text[pos])) ||
+        !isxdigit(static_cast<unsigned char>(text[pos + 1]))) {
+      return false;
+    }
+    mac[i] = static_cast<uint8_t>(strtoul(text.substr(pos, 2).c_str(), nullptr, 16));
+    pos += 2;
+  }
+  return pos == text.size();
+}
+
+// Formatta un MAC come XX:XX:XX:XX:XX:XX in buf (almeno 18 byte), senza allocare
+inline void format_mac(const uint8_t *mac, char *buf) {
+  snprintf(buf, 18, "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// Formatta un MAC come XX:XX:XX:XX:XX:XX
+inline std::string format_mac(const uint8_t *mac) {
+  char buf[18];
+  format_mac(mac, buf);
+  return buf;
+}
+
+// Normalizza un MAC nel formato XX:XX:XX:XX:XX:XX; stringa vuota se non valido
+inline std::string normalize_mac(const std::string &text) {
+  uint8_t mac[6];
+  if (!parse_mac(text, mac)) return "";
+  return format_mac(mac);
+}
+
+// Indica se un MAC è già nel formato XX:XX:XX:XX:XX:XX (cifre maiuscole)
+inline bool is_normalized_mac(const std::string &text) {
+  if (text.size() != 17) return false;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    bool valid = (i % 3 == 2) ? c == ':' : (isdigit(static_cast<unsigned char>(c)) || (c >= 'A' && c <= 'F'));
+    if (!valid) return false;
+  }
+  return true;
+}
+
+// Converte un intero decimale senza segno a 32 bit. A differenza di strtoul
+// rifiuta segni, spazi e valori fuori intervallo (che strtoul accetterebbe
+// restituendo rispettivamente il complemento o ULONG_MAX).
+inline bool parse_uint32(const std::string &text, uint32_t *value) {
+  if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) return false;
+  char *end = nullptr;
+  errno = 0;
+  unsigned long long parsed = strtoull(text.c_str(), &end, 10);
+  if (*end != '\0' || errno == ERANGE || parsed > UINT32_MAX) return false;
+  *value = static_cast<uint32_t>(parsed);
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Formato CSV: una riga di intestazione "mac,name,action,expires_in" e una
+// riga per dispositivo. I campi con virgole o virgolette sono tra virgolette.
+
+static const char *const REGISTRY_CSV_HEADER = "mac,name,action,expires_in";
+
+inline void append_csv_field(std::string *out, const std::string &value) {
+  if (value.find_first_of(",\"\r\n") == std::string::npos) {
+    out->append(value);
+    return;
+  }
+  out->push_back('"');
+  for (char c : value) {
+    if (c == '"') out->push_back('"');
+    out->push_back(c);
+  }
+  out->push_back('"');
+}
+
+inline void encode_csv_record(std::string *out, const RegistryRecord &record) {
+  out->append(format_mac(record.mac));
+  out->push_back(',');
+  append_csv_field(out, record.name);
+  out->push_back(',');
+  append_csv_field(out, record.action_id);
+  char buf[16];
+  snprintf(buf, sizeof(buf), ",%u\n", record.expires_in);
+  out->append(buf);
+}
+
+// Divide una riga CSV nei suoi campi; false se le virgolette non sono chiuse
+inline bool split_csv_line(const std::string &line, std::vector<std::string> *fields) {
+  fields->clear();
+  fields->emplace_back();
+  bool quoted = false;
+  for (size_t i = 0; i < line.size(); i++) {
+    char c = line[i];
+    if (quoted) {
+      if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+        fields->back().push_back('"');
+        i++;
+      } else if (c == '"') {
+        quoted = false;
+      } else {
+        fields->back().push_back(c);
+      }
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == ',') {
+      fields->emplace_back();
+    } else {
+      fields->back().push_back(c);
+    }
+  }
+  return !quoted;
+}
+
+// ---------------------------------------------------------------------------
+// Formato binario compatto: intestazione 'B' 'K' versione, poi per ogni
+// dispositivo: 6 byte di MAC, varint(lunghezza) + nome, varint(lunghezza) +
+// azione, varint(secondi alla scadenza).
+
+static const uint8_t REGISTRY_BINARY_VERSION = 1;
+
+inline void encode_binary_header(std::string *out) {
+  out->push_back('B');
+  out->push_back('K');
+  out->push_back(static_cast<char>(REGISTRY_BINARY_VERSION));
+}
+
+inline void encode_binary_record(std::string *out, const RegistryRecord &record) {
+  uint8_t tmp[5];
+  out->append(reinterpret_cast<const char *>(record.mac), 6);
+  out->append(reinterpret_cast<const char *>(tmp), varint_encode(record.name.size(), tmp));
+  out->append(record.name);
+  out->append(reinterpret_cast<const char *>(tmp), varint_encode(record.action_id.size(), tmp));
+  out->append(record.action_id);
+  out->append(reinterpret_cast<const char *>(tmp), varint_encode(record.expires_in, tmp));
+}
+
+// Legge un varint da data[*pos..len); restituisce false se incompleto o non valido
+inline bool varint_decode(const uint8_t *data, size_t len, size_t *pos, uint32_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*pos >= len) return false;
+    uint8_t b = data[(*pos)++];
+    *value |= static_cast<uint32_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+// Risultato della decodifica di un record binario
+enum RegistryDecodeResult { REGISTRY_DECODE_OK, REGISTRY_DECODE_INCOMPLETE, REGISTRY_DECODE_INVALID };
+
+// Decodifica un record binario all'inizio di data; *consumed riceve i byte usati
+inline RegistryDecodeResult decode_binary_record(const uint8_t *data, size_t len, RegistryRecord *record,
+                                                 size_t *consumed) {
+  size_t pos = 6;
+  if (len < pos) return REGISTRY_DECODE_INCOMPLETE;
+  memcpy(record->mac, data, 6);
+
+  uint32_t name_len, action_len;
+  if (!varint_decode(data, len, &pos, &name_len)) {
+    return pos >= len ? REGISTRY_DECODE_INCOMPLETE : REGISTRY_DECODE_INVALID;
+  }
+  if (name_len > REGISTRY_MAX_NAME_LENGTH) return REGISTRY_DECODE_INVALID;
+  if (pos + name_len > len) return REGISTRY_DECODE_INCOMPLETE;
+  record->name.assign(reinterpret_cast<const char *>(data + pos), name_len);
+  pos += name_len;
+
+  if (!varint_decode(data, len, &pos, &action_len)) {
+    return pos >= len ? REGISTRY_DECODE_INCOMPLETE : REGISTRY_DECODE_INVALID;
+  }
+  if (action_len > REGISTRY_MAX_ACTION_LENGTH) return REGISTRY_DECODE_INVALID;
+  if (pos + action_len > len) return REGISTRY_DECODE_INCOMPLETE;
+  record->action_id.assign(reinterpret_cast<const char *>(data + pos), action_len);
+  pos += action_len;
+
+  if (!varint_decode(data, len, &pos, &record->expires_in)) {
+    return pos >= len ? REGISTRY_DECODE_INCOMPLETE : REGISTRY_DECODE_INVALID;
+  }
+  *consumed = pos;
+  return REGISTRY_DECODE_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Lettore incrementale di un'importazione (CSV o binaria). I dati arrivano a
+// pezzi dal corpo della richiesta e vengono analizzati senza conservarli:
+// restano in memoria solo la riga corrente e i record già validati.
+class RegistryImporter {
+ public:
+  // Errori conservati per la risposta (gli altri vengono solo contati)
+  static const size_t MAX_REPORTED_ERRORS = 20;
+  // Lunghezza massima di una riga CSV o di un record binario
+  static const size_t MAX_LINE_LENGTH = 256;
+
+  struct Error {
+    uint32_t line;
+    const char *message;
+  };
+
+  explicit RegistryImporter(bool binary) : binary_(binary) {}
+
+  void feed(const uint8_t *data, size_t len) {
+    if (failed_) {
+      return;
+    }
+    if (binary_) {
+      feed_binary_(data, len);
+    } else {
+      feed_csv_(data, len);
+    }
+  }
+
+  // Termina l'importazione elaborando gli eventuali dati rimasti
+  void finish() {
+    if (failed_) {
+      // Errore già segnalato
+    } else if (binary_) {
+      if (!header_done_) {
+        add_error_(0, "Intestazione binaria mancante");
+      } else if (!line_.empty()) {
+        add_error_(line_number_ + 1, "Record binario incompleto");
+      }
+    } else if (!line_.empty() || overflow_) {
+      end_csv_line_();
+    }
+    line_.clear();
+  }
+
+  const std::vector<RegistryRecord> &records() const { return records_; }
+  const std::vector<Error> &errors() const { return errors_; }
+  uint32_t error_count() const { return error_count_; }
+
+ private:
+  bool binary_;
+  bool header_done_ = false;
+  bool overflow_ = false;
+  bool failed_ = false; // Flusso binario non più interpretabile
+  uint32_t line_number_ = 0;
+  std::string line_;
+  std::vector<std::string> fields_;
+  std::vector<RegistryRecord> records_;
+  std::vector<Error> errors_;
+  uint32_t error_count_ = 0;
+
+  void add_error_(uint32_t line, const char *message) {
+    error_count_++;
+    if (errors_.size() < MAX_REPORTED_ERRORS) {
+      errors_.push_back(Error{line, message});
+    }
+  }
+
+  void feed_csv_(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      char c = static_cast<char>(data[i]);
+      if (c == '\n') {
+        end_csv_line_();
+      } else if (c != '\r') {
+        if (line_.size() < MAX_LINE_LENGTH) {
+          line_.push_back(c);
+        } else {
+          overflow_ = true;
+        }
+      }
+    }
+  }
+
+  void end_csv_line_() {
+    line_number_++;
+    if (overflow_) {
+      add_error_(line_number_, "Riga troppo lunga");
+    } else if (line_number_ == 1 && line_.compare(0, 4, "mac,") == 0) {
+      // Intestazione facoltativa
+    } else if (!line_.empty()) {
+      parse_csv_line_();
+    }
+    line_.clear();
+    overflow_ = false;
+  }
+
+  void parse_csv_line_() {
+    if (!split_csv_line(line_, &fields_)) {
+      add_error_(line_number_, "Virgolette non chiuse");
+      return;
+    }
+    if (fields_.size() < 2 || fields_.size() > 4) {
+      add_error_(line_number_, "Numero di campi non valido");
+      return;
+    }
+
+    RegistryRecord record;
+    if (!parse_mac(fields_[0], record.mac)) {
+      add_error_(line_number_, "MAC non valido");
+      return;
+    }
+    record.name = fields_[1];
+    if (fields_.size() > 2) {
+      record.action_id = fields_[2];
+    }
+    if (fields_.size() > 3 && !fields_[3].empty() && !parse_uint32(fields_[3], &record.expires_in)) {
+      add_error_(line_number_, "Scadenza non valida");
+      return;
+    }
+    add_record_(record);
+  }
+
+  void feed_binary_(const uint8_t *data, size_t len) {
+    line_.append(reinterpret_cast<const char *>(data), len);
+
+    size_t pos = 0;
+    if (!header_done_) {
+      if (line_.size() < 3) return;
+      if (line_[0] != 'B' || line_[1] != 'K' || line_[2] != static_cast<char>(REGISTRY_BINARY_VERSION)) {
+        // Senza un'intestazione valida il resto non è interpretabile
+        add_error_(0, "Intestazione binaria non valida");
+        failed_ = true;
+        line_.clear();
+        return;
+      }
+      header_done_ = true;
+      pos = 3;
+    }
+
+    const uint8_t *buf = reinterpret_cast<const uint8_t *>(line_.data());
+    while (pos < line_.size()) {
+      RegistryRecord record;
+      size_t consumed = 0;
+      RegistryDecodeResult result = decode_binary_record(buf + pos, line_.size() - pos, &record, &consumed);
+      if (result == REGISTRY_DECODE_INCOMPLETE) {
+        break;
+      }
+      line_number_++;
+      if (result == REGISTRY_DECODE_INVALID) {
+        // Record non decodificabile: i successivi non sono più allineati
+        add_error_(line_number_, "Record binario non valido");
+        pos = line_.size();
+        failed_ = true;
+        break;
+      }
+      pos += consumed;
+      add_record_(record);
+    }
+    line_.erase(0, pos);
+  }
+
+  void add_record_(const RegistryRecord &record) {
+    if (record.name.empty()) {
+      add_error_(line_number_, "Nome mancante");
+    } else if (record.name.size() > REGISTRY_MAX_NAME_LENGTH) {
+      add_error_(line_number_, "Nome troppo lungo");
+    } else if (record.action_id.size() > REGISTRY_MAX_ACTION_LENGTH) {
+      add_error_(line_number_, "Azione troppo lunga");
+    } else if (record.expires_in > REGISTRY_MAX_DURATION) {
+      add_error_(line_number_, "Scadenza non valida");
+    } else if (records_.size() >= REGISTRY_MAX_DEVICES) {
+      // Oltre la capienza del registro i record non vengono conservati
+      add_error_(line_number_, "Troppi dispositivi");
+    } else {
+      records_.push_back(record);
+    }
+  }
+};
+
+} // namespace esphome
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "esphome.h"
+#include "ble_device_manager.h"
+#include "registry_codec.h"
+#include <mutex>
+#include <string>
+
+namespace esphome {
+
+// Esporta il registro a pezzi per una risposta chunked, in CSV o nel formato
+// binario compatto. Come per la pagina principale, viene codificato un solo
+// dispositivo alla volta leggendo il registro tramite un cursore.
+class RegistryExportStream {
+ public:
+  RegistryExportStream(BLEDeviceManager *device_manager, bool binary)
+      : device_manager_(device_manager), binary_(binary) {
+    pending_.reserve(160);
+  }
+
+  // Riempie il buffer con il prossimo pezzo dell'esportazione; 0 indica la fine
+  size_t fill(uint8_t *buffer, size_t max_len) {
+    std::lock_guard<std::recursive_mutex> lock(device_manager_->get_mutex());
+    size_t written = 0;
+    while (written < max_len) {
+      if (pending_pos_ >= pending_.size()) {
+        pending_.clear();
+        pending_pos_ = 0;
+        if (!encode_next_()) {
+          break;
+        }
+        continue;
+      }
+      size_t len = pending_.size() - pending_pos_;
+      if (len > max_len - written) {
+        len = max_len - written;
+      }
+      memcpy(buffer + written, pending_.data() + pending_pos_, len);
+      pending_pos_ += len;
+      written += len;
+    }
+    return written;
+  }
+
+ private:
+  BLEDeviceManager *device_manager_;
+  bool binary_;
+  bool header_done_ = false;
+  size_t cursor_ = 0;
+  std::string pending_;
+  size_t pending_pos_ = 0;
+
+  // Codifica l'intestazione o il prossimo dispositivo; false alla fine
+  bool encode_next_() {
+    if (!header_done_) {
+      header_done_ = true;
+      if (binary_) {
+        encode_binary_header(&pending_);
+      } else {
+        pending_.append(REGISTRY_CSV_HEADER);
+        pending_.push_back('\n');
+      }
+      return true;
+    }
+
+    const BLEDeviceManager::BLEDevice *device = device_manager_->get_device_at(cursor_++);
+    if (device == nullptr) {
+      return false;
+    }
+    RegistryRecord record = device_manager_->to_record(*device);
+    if (binary_) {
+      encode_binary_record(&pending_, record);
+    } else {
+      encode_csv_record(&pending_, record);
+    }
+    return true;
+  }
+};
+
+} // namespace esphome
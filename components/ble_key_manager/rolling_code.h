@@ -0,0 +1,157 @@
+#pragma once
+
+#include "hmac_sha256.h"
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+
+// Token a codice variabile trasmesso dai badge nei dati del produttore
+// dell'annuncio BLE (dopo l'identificativo del produttore):
+//   versione (1 byte), contatore (4 byte little endian), firma (8 byte)
+// La firma sono i primi 8 byte di HMAC-SHA256(chiave, MAC || contatore),
+// con il MAC nell'ordine di visualizzazione e il contatore little endian.
+// Il badge incrementa il contatore ad ogni nuovo token.
+static const uint8_t ROLLING_TOKEN_VERSION = 1;
+static const size_t ROLLING_TOKEN_SIZE = 1 + 4 + 8;
+static const size_t ROLLING_TAG_SIZE = 8;
+static const size_t ROLLING_KEY_SIZE = 16;
+// Un token è accettato solo se il contatore è nella finestra
+// (ultimo accettato, ultimo accettato + ROLLING_COUNTER_WINDOW]
+static const uint32_t ROLLING_COUNTER_WINDOW = 1024;
+
+struct RollingToken {
+  uint32_t counter = 0;
+  uint8_t tag[ROLLING_TAG_SIZE] = {};
+};
+
+// Estrae il token dai dati del produttore; false se il formato non corrisponde
+inline bool parse_rolling_token(const uint8_t *data, size_t len, RollingToken *token) {
+  if (len != ROLLING_TOKEN_SIZE || data[0] != ROLLING_TOKEN_VERSION) {
+    return false;
+  }
+  token->counter = data[1] | (data[2] << 8) | (data[3] << 16) | (static_cast<uint32_t>(data[4]) << 24);
+  memcpy(token->tag, data + 5, ROLLING_TAG_SIZE);
+  return true;
+}
+
+// Calcola la firma attesa per un MAC e un contatore
+inline void compute_rolling_tag(const uint8_t *key, size_t key_len, const uint8_t *mac, uint32_t counter,
+                                uint8_t *tag) {
+  uint8_t message[6 + 4];
+  memcpy(message, mac, 6);
+  message[6] = counter;
+  message[7] = counter >> 8;
+  message[8] = counter >> 16;
+  message[9] = counter >> 24;
+  uint8_t digest[SHA256::DIGEST_SIZE];
+  HMACSHA256(key, key_len).sign(message, sizeof(message), digest);
+  memcpy(tag, digest, ROLLING_TAG_SIZE);
+}
+
+// Esito della verifica di un token
+enum RollingVerdict {
+  ROLLING_OK,
+  ROLLING_REPLAYED,  // Token già visto (cache) o contatore non successivo all'ultimo accettato
+  ROLLING_BAD_TAG,   // Firma errata
+  ROLLING_OUT_OF_WINDOW,  // Contatore troppo avanti rispetto all'ultimo accettato
+};
+
+// Verifica dei token. Prima dell'HMAC vengono fatti due controlli a costo
+// costante: il contatore deve essere nella finestra dopo l'ultimo accettato
+// per il dispositivo e il token non deve essere tra quelli già esaminati (una
+// piccola cache di impronte, che scarta subito anche i token falsi ripetuti).
+class RollingCodeVerifier {
+ public:
+  static const size_t REPLAY_CACHE_SIZE = 16;
+
+  // Verifica token per il dispositivo mac (6 byte) con chiave key;
+  // se valido aggiorna *last_counter
+  RollingVerdict verify(const uint8_t *key, size_t key_len, const uint8_t *mac, const RollingToken &token,
+                        uint32_t *last_counter) {
+    if (token.counter <= *last_counter) {
+      rejected_replay_++;
+      return ROLLING_REPLAYED;
+    }
+    if (token.counter - *last_counter > ROLLING_COUNTER_WINDOW) {
+      rejected_window_++;
+      return ROLLING_OUT_OF_WINDOW;
+    }
+    uint64_t fingerprint = fingerprint_(mac, token);
+    for (uint64_t seen : replay_cache_) {
+      if (seen == fingerprint) {
+        rejected_replay_++;
+        return ROLLING_REPLAYED;
+      }
+    }
+    replay_cache_[replay_next_] = fingerprint;
+    replay_next_ = (replay_next_ + 1) % REPLAY_CACHE_SIZE;
+
+    uint8_t expected[ROLLING_TAG_SIZE];
+    compute_rolling_tag(key, key_len, mac, token.counter, expected);
+    if (!constant_time_equal(expected, token.tag, ROLLING_TAG_SIZE)) {
+      rejected_tag_++;
+      return ROLLING_BAD_TAG;
+    }
+    *last_counter = token.counter;
+    accepted_++;
+    return ROLLING_OK;
+  }
+
+  // Controlla un token ricevuto senza consumarlo: se il contatore è oltre
+  // *last_counter e la firma è valida *last_counter diventa counter - 1, così
+  // i token precedenti (ad esempio intercettati) non valgono più mentre
+  // quello ricevuto resta utilizzabile. Con bounded false il contatore può
+  // avanzare anche oltre la finestra, per riallinearsi a un badge che ha
+  // emesso molti token.
+  bool track(const uint8_t *key, size_t key_len, const uint8_t *mac, const RollingToken &token,
+             uint32_t *last_counter, bool bounded) {
+    if (token.counter <= *last_counter) {
+      rejected_replay_++;
+      return false;
+    }
+    if (bounded && token.counter - *last_counter > ROLLING_COUNTER_WINDOW) {
+      rejected_window_++;
+      return false;
+    }
+    uint8_t expected[ROLLING_TAG_SIZE];
+    compute_rolling_tag(key, key_len, mac, token.counter, expected);
+    if (!constant_time_equal(expected, token.tag, ROLLING_TAG_SIZE)) {
+      rejected_tag_++;
+      return false;
+    }
+    *last_counter = token.counter - 1;
+    tracked_++;
+    return true;
+  }
+
+  uint32_t get_accepted() const { return accepted_; }
+  uint32_t get_tracked() const { return tracked_; }
+  uint32_t get_rejected_replay() const { return rejected_replay_; }
+  uint32_t get_rejected_tag() const { return rejected_tag_; }
+  uint32_t get_rejected_window() const { return rejected_window_; }
+
+ private:
+  uint64_t replay_cache_[REPLAY_CACHE_SIZE] = {};
+  size_t replay_next_ = 0;
+  uint32_t accepted_ = 0;
+  uint32_t tracked_ = 0;
+  uint32_t rejected_replay_ = 0;
+  uint32_t rejected_tag_ = 0;
+  uint32_t rejected_window_ = 0;
+
+  // Impronta non crittografica di MAC, contatore e firma (FNV-1a a 64 bit)
+  static uint64_t fingerprint_(const uint8_t *mac, const RollingToken &token) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto mix = [&hash](uint8_t byte) {
+      hash ^= byte;
+      hash *= 0x100000001b3ULL;
+    };
+    for (size_t i = 0; i < 6; i++) mix(mac[i]);
+    for (size_t i = 0; i < 4; i++) mix(token.counter >> (8 * i));
+    for (size_t i = 0; i < ROLLING_TAG_SIZE; i++) mix(token.tag[i]);
+    return hash | 1; // 0 indica una voce vuota
+  }
+};
+
+} // namespace esphome
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Dimensione (in byte) dello storico RSSI per ogni dispositivo.
+// Può essere impostata da __init__.py con l'opzione rssi_history_size.
+#ifndef BLE_KEY_MANAGER_RSSI_HISTORY_SIZE
+#define BLE_KEY_MANAGER_RSSI_HISTORY_SIZE 256
+#endif
+
+namespace esphome {
+
+// Codifica zigzag: mappa gli interi con segno su interi senza segno piccoli
+inline uint32_t zigzag_encode(int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+inline int32_t zigzag_decode(uint32_t value) {
+  return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+// Dimensione massima di un campione codificato (due varint)
+static const size_t RSSI_MAX_RECORD_SIZE = 10;
+
+// Scrive un varint (7 bit per byte) e restituisce il numero di byte usati
+inline size_t varint_encode(uint32_t value, uint8_t *out) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = static_cast<uint8_t>(value);
+  return len;
+}
+
+// Anello di byte a dimensione fissa contenente campioni (tempo, RSSI).
+// Ogni campione è salvato come differenza rispetto al precedente:
+// varint(delta tempo) + varint(zigzag(delta RSSI)). Lo stato "base"
+// rappresenta il campione che precede il più vecchio presente nell'anello,
+// così quando un campione viene scartato basta accumularlo nella base.
+template<uint16_t N> class RSSISampleRing {
+ public:
+  void push(uint32_t time, int8_t rssi) {
+    if (count_ == 0) {
+      base_time_ = last_time_ = time;
+      base_rssi_ = last_rssi_ = rssi;
+    }
+
+    uint8_t record[RSSI_MAX_RECORD_SIZE];
+    uint32_t dt = (time >= last_time_) ? (time - last_time_) : 0;
+    size_t len = varint_encode(dt, record);
+    len += varint_encode(zigzag_encode(static_cast<int32_t>(rssi) - last_rssi_), record + len);
+
+    // Libera spazio scartando i campioni più vecchi
+    while (static_cast<size_t>(N - used_) < len) {
+      uint32_t t;
+      int8_t r;
+      pop(&t, &r);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+      buf_[(head_ + used_ + i) % N] = record[i];
+    }
+    used_ += len;
+    count_++;
+    last_time_ += dt;
+    last_rssi_ = rssi;
+  }
+
+  // Rimuove il campione più vecchio restituendone il valore
+  bool pop(uint32_t *time, int8_t *rssi) {
+    if (count_ == 0) return false;
+    size_t pos = head_;
+    uint32_t dt = read_varint_(&pos);
+    int32_t dr = zigzag_decode(read_varint_(&pos));
+    size_t len = (pos + N - head_) % N;
+    if (len == 0) len = N;
+
+    base_time_ += dt;
+    base_rssi_ = static_cast<int8_t>(base_rssi_ + dr);
+    head_ = pos % N;
+    used_ -= len;
+    count_--;
+
+    *time = base_time_;
+    *rssi = base_rssi_;
+    return true;
+  }
+
+  // Visita i campioni dal più vecchio al più recente
+  template<typename F> void for_each(F callback) const {
+    uint32_t time = base_time_;
+    int32_t rssi = base_rssi_;
+    size_t pos = head_;
+    for (uint16_t i = 0; i < count_; i++) {
+      time += read_varint_(&pos);
+      rssi += zigzag_decode(read_varint_(&pos));
+      callback(time, static_cast<int8_t>(rssi));
+    }
+  }
+
+  uint16_t size() const { return count_; }
+  uint16_t bytes_used() const { return used_; }
+  bool empty() const { return count_ == 0; }
+
+ private:
+  uint8_t buf_[N];
+  uint16_t head_ = 0;
+  uint16_t used_ = 0;
+  uint16_t count_ = 0;
+  uint32_t base_time_ = 0;
+  uint32_t last_time_ = 0;
+  int8_t base_rssi_ = 0;
+  int8_t last_rssi_ = 0;
+
+  uint32_t read_varint_(size_t *pos) const {
+    uint32_t value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      uint8_t b = buf_[*pos % N];
+      *pos = (*pos + 1) % N;
+      value |= static_cast<uint32_t>(b & 0x7F) << shift;
+      if (!(b & 0x80)) break;
+    }
+    return value;
+  }
+};
+
+// Storico RSSI di un dispositivo a memoria fissa.
+// I campioni recenti sono mantenuti con la risoluzione originale; quando lo
+// spazio finisce i più vecchi vengono ridotti a medie per minuto.
+class RSSIHistory {
+ public:
+  static const uint16_t RAW_SIZE = BLE_KEY_MANAGER_RSSI_HISTORY_SIZE / 2;
+  static const uint16_t MINUTE_SIZE = BLE_KEY_MANAGER_RSSI_HISTORY_SIZE - RAW_SIZE;
+
+  // Aggiunge un campione (tempo in secondi)
+  void add_sample(uint32_t time, int32_t rssi) {
+    if (rssi < -128) rssi = -128;
+    if (rssi > 127) rssi = 127;
+
+    // Se il campione non entra, i più vecchi passano al livello per minuto
+    while (!raw_.empty() && static_cast<size_t>(RAW_SIZE - raw_.bytes_used()) < RSSI_MAX_RECORD_SIZE) {
+      uint32_t t;
+      int8_t r;
+      raw_.pop(&t, &r);
+      add_to_bucket_(t, r);
+    }
+    raw_.push(time, static_cast<int8_t>(rssi));
+  }
+
+  // Visita tutti i campioni in ordine cronologico: prima le medie per minuto,
+  // poi i campioni a piena risoluzione. Il callback riceve (tempo, rssi, per_minuto).
+  template<typename F> void for_each(F callback) const {
+    minutes_.for_each([&](uint32_t t, int8_t r) { callback(t, r, true); });
+    if (bucket_count_ > 0) {
+      callback(bucket_minute_ * 60, static_cast<int8_t>(bucket_sum_ / bucket_count_), true);
+    }
+    raw_.for_each([&](uint32_t t, int8_t r) { callback(t, r, false); });
+  }
+
+  // Serializza la serie in formato binario compatto:
+  // 'R' 'H' versione, varint(numero campioni), poi per ogni campione
+  // varint(delta tempo) e varint(zigzag(delta RSSI)) a partire da (0, 0).
+  void encode(std::string *out) const {
+    uint8_t tmp[RSSI_MAX_RECORD_SIZE];
+    out->push_back('R');
+    out->push_back('H');
+    out->push_back(1);
+    size_t len = varint_encode(sample_count(), tmp);
+    out->append(reinterpret_cast<const char *>(tmp), len);
+
+    uint32_t prev_time = 0;
+    int32_t prev_rssi = 0;
+    for_each([&](uint32_t t, int8_t r, bool) {
+      size_t n = varint_encode(t - prev_time, tmp);
+      n += varint_encode(zigzag_encode(r - prev_rssi), tmp + n);
+      out->append(reinterpret_cast<const char *>(tmp), n);
+      prev_time = t;
+      prev_rssi = r;
+    });
+  }
+
+  uint32_t sample_count() const { return raw_.size() + minutes_.size() + (bucket_count_ > 0 ? 1 : 0); }
+  uint32_t bytes_used() const { return raw_.bytes_used() + minutes_.bytes_used(); }
+
+ private:
+  RSSISampleRing<RAW_SIZE> raw_;
+  RSSISampleRing<MINUTE_SIZE> minutes_;
+
+  // Minuto in costruzione
+  uint32_t bucket_minute_ = 0;
+  int32_t bucket_sum_ = 0;
+  uint16_t bucket_count_ = 0;
+
+  void add_to_bucket_(uint32_t time, int8_t rssi) {
+    uint32_t minute = time / 60;
+    if (bucket_count_ > 0 && minute != bucket_minute_) {
+      minutes_.push(bucket_minute_ * 60, static_cast<int8_t>(bucket_sum_ / bucket_count_));
+      bucket_count_ = 0;
+      bucket_sum_ = 0;
+    }
+    bucket_minute_ = minute;
+    bucket_sum_ += rssi;
+    bucket_count_++;
+  }
+};
+
+} // namespace esphome
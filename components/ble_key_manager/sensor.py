@@ -0,0 +1,50 @@
+"""Sensori dei contatori aggregati di BLE Key Manager."""
+
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import sensor
+from esphome.const import STATE_CLASS_MEASUREMENT
+
+from . import BLEDeviceManager
+
+DEPENDENCIES = ['ble_key_manager']
+
+CONF_BLE_KEY_MANAGER_ID = 'ble_key_manager_id'
+CONF_AUTHORIZED = 'authorized'
+CONF_ACTIVE = 'active'
+CONF_EXPIRED = 'expired'
+CONF_MIN_INTERVAL = 'min_interval'
+
+def count_schema(icon):
+    return sensor.sensor_schema(
+        icon=icon,
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+    )
+
+# I contatori sono mantenuti da BLEDeviceManager ad ogni modifica: i sensori
+# vengono pubblicati solo quando un valore cambia, al massimo una volta per
+# min_interval
+CONFIG_SCHEMA = cv.Schema({
+    cv.GenerateID(CONF_BLE_KEY_MANAGER_ID): cv.use_id(BLEDeviceManager),
+    cv.Optional(CONF_AUTHORIZED): count_schema('mdi:key'),
+    cv.Optional(CONF_ACTIVE): count_schema('mdi:bluetooth'),
+    cv.Optional(CONF_EXPIRED): count_schema('mdi:key-remove'),
+    cv.Optional(CONF_MIN_INTERVAL, default='1s'): cv.positive_time_period_milliseconds,
+})
+
+async def to_code(config):
+    parent = await cg.get_variable(config[CONF_BLE_KEY_MANAGER_ID])
+    cg.add(parent.set_min_publish_interval(config[CONF_MIN_INTERVAL]))
+    
+    if CONF_AUTHORIZED in config:
+        sens = await sensor.new_sensor(config[CONF_AUTHORIZED])
+        cg.add(parent.set_authorized_sensor(sens))
+    
+    if CONF_ACTIVE in config:
+        sens = await sensor.new_sensor(config[CONF_ACTIVE])
+        cg.add(parent.set_active_sensor(sens))
+    
+    if CONF_EXPIRED in config:
+        sens = await sensor.new_sensor(config[CONF_EXPIRED])
+        cg.add(parent.set_expired_sensor(sens))
@@ -0,0 +1,324 @@
+#pragma once
+
+#include "ble_ingest.h"
+#include "registry_codec.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace esphome {
+
+// ---------------------------------------------------------------------------
+// Pacchetto di rilevazioni scambiato tra nodi:
+//   'F' 'S' versione, varint(nodo), varint(ora di invio in ms, orologio del
+//   nodo), varint(numero di rilevazioni)
+// poi per ogni rilevazione, in ordine di tempo:
+//   varint(riferimento MAC): 0 = MAC nuovo seguito da 6 byte, k = k-esimo
+//   MAC già comparso nel pacchetto; varint(ms dalla rilevazione precedente,
+//   per la prima ms prima dell'invio); RSSI (1 byte).
+// Un dispositivo già comparso costa 3 byte per rilevazione.
+
+static const uint8_t SIGHTING_BATCH_VERSION = 1;
+static const size_t SIGHTING_BATCH_MAX_SIZE = 1200; // Sta in un datagramma UDP senza frammentazione
+static const size_t SIGHTING_BATCH_MAX_COUNT = 400;
+
+// Accumula le rilevazioni da inviare agli altri nodi
+class SightingBatchEncoder {
+ public:
+  static const size_t MAX_MACS = 64;
+
+  // Aggiunge una rilevazione; false se il pacchetto è pieno
+  bool add(const Sighting &sighting) {
+    if (count_ >= SIGHTING_BATCH_MAX_COUNT || body_.size() + 6 + 5 + 1 + HEADER_RESERVE > SIGHTING_BATCH_MAX_SIZE) {
+      return false;
+    }
+    size_t ref = 0;
+    for (size_t i = 0; i < macs_.size(); i++) {
+      if (macs_[i] == sighting.mac) {
+        ref = i + 1;
+        break;
+      }
+    }
+    if (ref == 0 && macs_.size() >= MAX_MACS) {
+      return false;
+    }
+
+    uint8_t tmp[5];
+    body_.append(reinterpret_cast<const char *>(tmp), varint_encode(ref, tmp));
+    if (ref == 0) {
+      uint8_t mac[6];
+      u64_to_mac(sighting.mac, mac);
+      body_.append(reinterpret_cast<const char *>(mac), 6);
+      macs_.push_back(sighting.mac);
+    }
+    // Il primo tempo viene scritto in finish(), quando è nota l'ora di invio
+    uint32_t timestamp = (count_ > 0 && sighting.timestamp_ms - last_timestamp_ > 0x80000000u)
+                             ? last_timestamp_ : sighting.timestamp_ms;
+    if (count_ == 0) {
+      first_timestamp_ = timestamp;
+    } else {
+      body_.append(reinterpret_cast<const char *>(tmp), varint_encode(timestamp - last_timestamp_, tmp));
+    }
+    body_.push_back(static_cast<char>(sighting.rssi));
+    last_timestamp_ = timestamp;
+    count_++;
+    return true;
+  }
+
+  bool empty() const { return count_ == 0; }
+
+  // Completa il pacchetto e prepara il codificatore per il successivo
+  std::string finish(uint32_t node_id, uint32_t send_time_ms) {
+    std::string packet;
+    uint8_t tmp[5];
+    packet.push_back('F');
+    packet.push_back('S');
+    packet.push_back(static_cast<char>(SIGHTING_BATCH_VERSION));
+    packet.append(reinterpret_cast<const char *>(tmp), varint_encode(node_id, tmp));
+    packet.append(reinterpret_cast<const char *>(tmp), varint_encode(send_time_ms, tmp));
+    packet.append(reinterpret_cast<const char *>(tmp), varint_encode(count_, tmp));
+    if (count_ > 0) {
+      // Il tempo della prima rilevazione (sempre un MAC nuovo) segue il suo MAC
+      size_t first_len = 1 + 6;
+      uint32_t age = send_time_ms - first_timestamp_ > 0x80000000u ? 0 : send_time_ms - first_timestamp_;
+      packet.append(body_, 0, first_len);
+      packet.append(reinterpret_cast<const char *>(tmp), varint_encode(age, tmp));
+      packet.append(body_, first_len, std::string::npos);
+    }
+    body_.clear();
+    macs_.clear();
+    count_ = 0;
+    return packet;
+  }
+
+ private:
+  static const size_t HEADER_RESERVE = 3 + 3 * 5 + 5;
+
+  std::string body_;
+  std::vector<uint64_t> macs_;
+  size_t count_ = 0;
+  uint32_t first_timestamp_ = 0;
+  uint32_t last_timestamp_ = 0;
+};
+
+// Decodifica un pacchetto; i tempi delle rilevazioni restano nell'orologio
+// del nodo mittente
+inline bool decode_sighting_batch(const uint8_t *data, size_t len, uint32_t *node_id, uint32_t *send_time_ms,
+                                  std::vector<Sighting> *sightings) {
+  if (len < 3 || data[0] != 'F' || data[1] != 'S' || data[2] != SIGHTING_BATCH_VERSION) {
+    return false;
+  }
+  size_t pos = 3;
+  uint32_t count;
+  if (!varint_decode(data, len, &pos, node_id) || !varint_decode(data, len, &pos, send_time_ms) ||
+      !varint_decode(data, len, &pos, &count) || count > SIGHTING_BATCH_MAX_COUNT) {
+    return false;
+  }
+
+  std::vector<uint64_t> macs;
+  sightings->clear();
+  sightings->reserve(count);
+  uint32_t timestamp = *send_time_ms;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t ref, delta;
+    Sighting sighting;
+    if (!varint_decode(data, len, &pos, &ref)) return false;
+    if (ref == 0) {
+      if (pos + 6 > len) return false;
+      sighting.mac = mac_to_u64(data + pos);
+      pos += 6;
+      macs.push_back(sighting.mac);
+    } else if (ref <= macs.size()) {
+      sighting.mac = macs[ref - 1];
+    } else {
+      return false;
+    }
+    if (!varint_decode(data, len, &pos, &delta) || pos >= len) return false;
+    timestamp = (i == 0) ? *send_time_ms - delta : timestamp + delta;
+    sighting.timestamp_ms = timestamp;
+    sighting.rssi = static_cast<int8_t>(data[pos++]);
+    sightings->push_back(sighting);
+  }
+  return pos == len;
+}
+
+// ---------------------------------------------------------------------------
+// Stima della posizione di un dispositivo combinando le rilevazioni di più
+// nodi. Per ogni nodo viene tenuto l'RSSI smussato (media esponenziale) e
+// il tempo dell'ultima rilevazione nell'orologio locale; le letture più
+// vecchie della finestra non contano.
+struct FusedEstimate {
+  int8_t max_rssi = -127;      // RSSI del nodo più vicino
+  int8_t weighted_rssi = -127; // Media pesata per freschezza su tutti i nodi
+  uint32_t nearest_node = 0;   // Nodo con l'RSSI più alto
+  uint8_t nodes = 0;           // Nodi che vedono il dispositivo
+};
+
+class SightingFusion {
+ public:
+  static const size_t MAX_NODES = 8;
+  static const size_t MAX_DEVICES = 64;
+
+  // Durata di validità di una lettura (ms)
+  void set_window(uint32_t window_ms) { window_ms_ = window_ms; }
+
+  // Aggiorna la differenza tra l'orologio di un nodo e quello locale alla
+  // ricezione di un pacchetto. Viene seguito il valore minimo osservato,
+  // che esclude i ritardi di rete, lasciandolo risalire lentamente per
+  // seguire la deriva degli orologi. false se non c'è posto per il nodo.
+  bool observe_clock(uint32_t node_id, uint32_t send_time_ms, uint32_t local_now_ms) {
+    NodeClock *clock = find_node_(node_id, true);
+    if (clock == nullptr) {
+      return false;
+    }
+    int32_t offset = static_cast<int32_t>(local_now_ms - send_time_ms);
+    if (!clock->synced || offset < clock->offset) {
+      clock->offset = offset;
+      clock->synced = true;
+    } else {
+      clock->offset += (offset - clock->offset + 15) / 16;
+    }
+    return true;
+  }
+
+  // Converte un tempo del nodo nell'orologio locale
+  uint32_t to_local_time(uint32_t node_id, uint32_t node_time_ms) {
+    NodeClock *clock = find_node_(node_id, false);
+    return clock != nullptr ? node_time_ms + clock->offset : node_time_ms;
+  }
+
+  // Registra una lettura (tempo già nell'orologio locale)
+  void add(uint32_t node_id, uint64_t mac, int8_t rssi, uint32_t local_time_ms) {
+    Track &track = find_track_(mac, local_time_ms);
+    Reading *reading = nullptr;
+    Reading *oldest = &track.readings[0];
+    for (auto &r : track.readings) {
+      if (r.used && r.node_id == node_id) {
+        reading = &r;
+        break;
+      }
+      if (!r.used) {
+        oldest = &r;
+      } else if (oldest->used && r.time_ms - oldest->time_ms > 0x80000000u) {
+        oldest = &r;
+      }
+    }
+
+    int16_t value = static_cast<int16_t>(rssi) * 16;
+    if (reading == nullptr) {
+      reading = oldest;
+      reading->used = true;
+      reading->node_id = node_id;
+      reading->rssi_x16 = value;
+      reading->time_ms = local_time_ms;
+    } else if (local_time_ms - reading->time_ms >= 0x80000000u) {
+      return; // Più vecchia dell'ultima lettura del nodo
+    } else if (local_time_ms - reading->time_ms < window_ms_) {
+      reading->rssi_x16 += (value - reading->rssi_x16) / 4;
+      reading->time_ms = local_time_ms;
+    } else {
+      reading->rssi_x16 = value;
+      reading->time_ms = local_time_ms;
+    }
+    if (local_time_ms - track.last_ms < 0x80000000u) {
+      track.last_ms = local_time_ms;
+    }
+  }
+
+  // Stima combinata per un dispositivo; false se nessun nodo lo vede
+  bool estimate(uint64_t mac, uint32_t now_ms, FusedEstimate *estimate) const {
+    for (const auto &track : tracks_) {
+      if (track.mac != mac) continue;
+
+      int64_t weighted = 0;
+      int64_t total_weight = 0;
+      int16_t best = INT16_MIN;
+      *estimate = FusedEstimate();
+      for (const auto &r : track.readings) {
+        uint32_t age = now_ms - r.time_ms;
+        if (!r.used || (age >= window_ms_ && age < 0x80000000u)) continue;
+        int64_t weight = (age >= 0x80000000u) ? window_ms_ : window_ms_ - age;
+        weighted += weight * r.rssi_x16;
+        total_weight += weight;
+        estimate->nodes++;
+        if (r.rssi_x16 > best) {
+          best = r.rssi_x16;
+          estimate->nearest_node = r.node_id;
+        }
+      }
+      if (estimate->nodes == 0) {
+        return false;
+      }
+      estimate->max_rssi = best / 16;
+      estimate->weighted_rssi = total_weight > 0 ? weighted / total_weight / 16 : estimate->max_rssi;
+      return true;
+    }
+    return false;
+  }
+
+  uint32_t get_rejected_nodes() const { return rejected_nodes_; }
+
+ private:
+  struct NodeClock {
+    uint32_t node_id = 0;
+    int32_t offset = 0;
+    bool synced = false;
+    bool used = false;
+  };
+
+  struct Reading {
+    uint32_t node_id = 0;
+    uint32_t time_ms = 0;
+    int16_t rssi_x16 = 0;
+    bool used = false;
+  };
+
+  struct Track {
+    uint64_t mac = 0;
+    uint32_t last_ms = 0;
+    Reading readings[MAX_NODES];
+  };
+
+  uint32_t window_ms_ = 5000;
+  NodeClock nodes_[MAX_NODES];
+  std::vector<Track> tracks_;
+  uint32_t rejected_nodes_ = 0;
+
+  NodeClock *find_node_(uint32_t node_id, bool create) {
+    for (auto &node : nodes_) {
+      if (node.used && node.node_id == node_id) return &node;
+    }
+    if (!create) return nullptr;
+    for (auto &node : nodes_) {
+      if (!node.used) {
+        node.used = true;
+        node.node_id = node_id;
+        return &node;
+      }
+    }
+    rejected_nodes_++;
+    return nullptr;
+  }
+
+  // Trova la traccia del dispositivo o sostituisce quella aggiornata meno di recente
+  Track &find_track_(uint64_t mac, uint32_t now_ms) {
+    Track *oldest = nullptr;
+    for (auto &track : tracks_) {
+      if (track.mac == mac) return track;
+      if (oldest == nullptr || now_ms - track.last_ms > now_ms - oldest->last_ms) {
+        oldest = &track;
+      }
+    }
+    if (tracks_.size() < MAX_DEVICES) {
+      tracks_.emplace_back();
+      oldest = &tracks_.back();
+    } else {
+      *oldest = Track();
+    }
+    oldest->mac = mac;
+    oldest->last_ms = now_ms;
+    return *oldest;
+  }
+};
+
+} // namespace esphome
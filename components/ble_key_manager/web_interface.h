@@ -1,7 +1,18 @@
 #pragma once
 
 #include "esphome.h"
+#include "alloc_tracker.h"
+#include "batch_operations.h"
 #include "ble_device_manager.h"
+#include "device_card_cache.h"
+#include "device_page_stream.h"
+#include "registry_codec.h"
+#include "rate_limiter.h"
+#include "registry_export_stream.h"
+#include "web_session.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
 
 namespace esphome {
 
@@ -9,159 +20,166 @@ class BLEWebInterface : public Component {
  public:
   BLEWebInterface(BLEDeviceManager *device_manager) : device_manager_(device_manager) {}
 
+  // Credenziali di accesso (da __init__.py)
+  void set_credentials(const std::string &username, const std::string &password) {
+    username_ = username;
+    password_ = password;
+  }
+
+  // Durata delle sessioni in secondi
+  void set_session_ttl(uint32_t seconds) {
+    sessions_.set_ttl(seconds);
+  }
+
+  // Limiti di frequenza: gettoni al secondo e capienza per client e globali,
+  // più il numero massimo di risposte contemporanee
+  void set_rate_limits(uint32_t client_rate, uint32_t client_burst, uint32_t global_rate, 
+                       uint32_t global_burst, uint32_t max_in_flight) {
+    rate_limiter_.set_client_rate(client_rate, client_burst);
+    rate_limiter_.set_global_rate(global_rate, global_burst);
+    rate_limiter_.set_max_in_flight(max_in_flight);
+  }
+
+  // Memoria massima per le schede dispositivo già generate (0 = nessuna cache)
+  void set_card_cache_size(size_t bytes) {
+    card_cache_.set_capacity(bytes);
+  }
+
   void setup() override {
+    // Chiave delle sessioni, nuova ad ogni avvio
+    rotate_session_secret_();
+    
     // Registra gli endpoint dell'API web
     register_web_handlers();
   }
 
  private:
   BLEDeviceManager *device_manager_;
+  // Senza credenziali configurate l'accesso è sempre negato
+  std::string username_;
+  std::string password_;
+  SessionManager sessions_;
+  RateLimiter rate_limiter_;
+  DeviceCardCache card_cache_;
+  
+  // Costo in gettoni delle richieste: le modifiche riscrivono la flash
+  static const uint32_t COST_READ = 1;
+  static const uint32_t COST_WRITE = 4;
+  static const uint32_t COST_BULK = 8;
+  
+  // Importazione in corso (una alla volta)
+  std::unique_ptr<RegistryImporter> importer_;
+  AsyncWebServerRequest *import_request_ = nullptr;
+  
+  // Gruppo di operazioni in ricezione (uno alla volta)
+  std::unique_ptr<BatchReader> batch_reader_;
+  AsyncWebServerRequest *batch_request_ = nullptr;
+  
+  // Richieste con corpo già rifiutate alla ricezione del primo pezzo
+  std::vector<AsyncWebServerRequest *> rejected_bodies_;
 
   // Registra gli handler per le richieste web
   void register_web_handlers() {
-    // Pagina principale
-    App.get_web_server()->on("/", HTTP_GET, [this](AsyncWebServerRequest *request) {
-      if (!request->authenticate("admin", "password")) { // Usa credenziali dal file secrets.yaml
-        return request->requestAuthentication();
+    // Pagina di accesso
+    App.get_web_server()->on("/login", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_LOGIN);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      send_login_page_(request, false);
+    });
+    
+    // Verifica le credenziali e apre una sessione
+    App.get_web_server()->on("/login", HTTP_POST, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_LOGIN);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      if (!request->hasParam("username", true) || !request->hasParam("password", true) ||
+          !credentials_match_(request->getParam("username", true)->value().c_str(), 
+                              request->getParam("password", true)->value().c_str())) {
+        send_login_page_(request, true);
+        return;
       }
       
-      AsyncResponseStream *response = request->beginResponseStream("text/html");
-      response->print(F("<!DOCTYPE html><html><head>"));
-      response->print(F("<meta charset=\"UTF-8\">"));
-      response->print(F("<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"));
-      response->print(F("<title>BLE Key Manager</title>"));
-      response->print(F("<style>"));
-      response->print(F("body{font-family:Arial,sans-serif;margin:0;padding:20px;line-height:1.6;}"));
-      response->print(F("h1{color:#333;}"));
-      response->print(F(".container{max-width:1200px;margin:0 auto;}"));
-      response->print(F(".card{background:#f9f9f9;border-radius:5px;padding:15px;margin-bottom:15px;box-shadow:0 2px 4px rgba(0,0,0,0.1);}"));
-      response->print(F(".device{display:flex;justify-content:space-between;align-items:center;}"));
-      response->print(F(".device-info{flex:1;}"));
-      response->print(F(".device-actions{display:flex;gap:10px;}"));
-      response->print(F("button{background:#4CAF50;color:white;border:none;padding:8px 12px;border-radius:4px;cursor:pointer;}"));
-      response->print(F("button.revoke{background:#f44336;}"));
-      response->print(F("button.edit{background:#2196F3;}"));
-      response->print(F(".add-form{margin-top:20px;}"));
-      response->print(F("input,select{padding:8px;margin-right:10px;border-radius:4px;border:1px solid #ddd;}"));
-      response->print(F(".authorized{color:green;font-weight:bold;}"));
-      response->print(F(".unauthorized{color:red;}"));
-      response->print(F("</style>"));
-      response->print(F("</head><body>"));
-      response->print(F("<div class=\"container\">"));
-      response->print(F("<h1>BLE Key Manager</h1>"));
+      std::string token = sessions_.issue(millis() / 1000, random_uint32());
+      char cookie[128];
+      snprintf(cookie, sizeof(cookie), "%s=%s; Path=/; HttpOnly; SameSite=Strict; Max-Age=%u", 
+               SESSION_COOKIE_NAME, token.c_str(), sessions_.get_ttl());
       
-      // Sezione dispositivi
-      response->print(F("<h2>Dispositivi BLE</h2>"));
+      AsyncWebServerResponse *response = request->beginResponse(302);
+      response->addHeader("Location", "/");
+      response->addHeader("Set-Cookie", cookie);
+      request->send(response);
+    });
+    
+    // Chiude la sessione corrente
+    App.get_web_server()->on("/logout", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_LOGOUT);
+      if (!admit_(request, COST_READ)) {
+        return;
+      }
+      std::string token = get_session_cookie_(request);
+      if (!token.empty() && !sessions_.revoke(token.c_str(), token.size(), millis() / 1000)) {
+        // Troppe revoche da ricordare: invalida tutte le sessioni
+        rotate_session_secret_();
+      }
       
-      auto devices = device_manager_->get_all_devices();
-      if (devices.empty()) {
-        response->print(F("<p>Nessun dispositivo registrato.</p>"));
-      } else {
-        for (const auto &device : devices) {
-          response->print(F("<div class=\"card\"><div class=\"device\">"));
-          
-          // Informazioni dispositivo
-          response->print(F("<div class=\"device-info\">"));
-          response->printf(F("<h3>%s</h3>"), device.name.c_str());
-          response->printf(F("<p>MAC: %s</p>"), device.mac_address.c_str());
-          
-          // Stato autorizzazione
-          if (device_manager_->is_device_authorized(device.mac_address)) {
-            response->print(F("<p class=\"authorized\">Autorizzato"));
-            
-            // Mostra scadenza se presente
-            if (device.expiry_time > 0) {
-              uint32_t current_time = millis() / 1000;
-              uint32_t remaining = (device.expiry_time > current_time) ? 
-                                   (device.expiry_time - current_time) : 0;
-              
-              uint32_t hours = remaining / 3600;
-              uint32_t minutes = (remaining % 3600) / 60;
-              uint32_t seconds = remaining % 60;
-              
-              response->printf(F(" (scade tra %02u:%02u:%02u)"), hours, minutes, seconds);
-            }
-            
-            response->print(F("</p>"));
-          } else {
-            response->print(F("<p class=\"unauthorized\">Non autorizzato</p>"));
-          }
-          
-          // Azione associata
-          if (!device.action_id.empty()) {
-            response->printf(F("<p>Azione: %s</p>"), device.action_id.c_str());
-          } else {
-            response->print(F("<p>Nessuna azione definita</p>"));
-          }
-          
-          // Ultima rilevazione
-          if (device.last_seen > 0) {
-            uint32_t current_time = millis() / 1000;
-            uint32_t seconds_ago = current_time - device.last_seen;
-            
-            if (seconds_ago < 60) {
-              response->printf(F("<p>Rilevato %u secondi fa (RSSI: %d dBm)</p>"), 
-                             seconds_ago, device.last_rssi);
-            } else if (seconds_ago < 3600) {
-              response->printf(F("<p>Rilevato %u minuti fa (RSSI: %d dBm)</p>"), 
-                             seconds_ago / 60, device.last_rssi);
-            } else {
-              response->printf(F("<p>Rilevato %u ore fa (RSSI: %d dBm)</p>"), 
-                             seconds_ago / 3600, device.last_rssi);
-            }
-          } else {
-            response->print(F("<p>Mai rilevato</p>"));
-          }
-          
-          response->print(F("</div>"));
-          
-          // Azioni dispositivo
-          response->print(F("<div class=\"device-actions\">"));
-          
-          // Pulsante autorizza/revoca
-          if (device_manager_->is_device_authorized(device.mac_address)) {
-            response->printf(F("<button class=\"revoke\" onclick=\"window.location.href='/revoke?mac=%s';\">Revoca</button>"), 
-                           device.mac_address.c_str());
-          } else {
-            response->printf(F("<button onclick=\"window.location.href='/authorize?mac=%s';\">Autorizza</button>"), 
-                           device.mac_address.c_str());
-            response->printf(F("<button onclick=\"window.location.href='/authorize_temp?mac=%s';\">Autorizza (24h)</button>"), 
-                           device.mac_address.c_str());
-          }
-          
-          // Pulsante modifica
-          response->printf(F("<button class=\"edit\" onclick=\"window.location.href='/edit?mac=%s';\">Modifica</button>"), 
-                         device.mac_address.c_str());
-          
-          // Pulsante elimina
-          response->printf(F("<button class=\"revoke\" onclick=\"if(confirm('Sei sicuro di voler eliminare questo dispositivo?')) window.location.href='/delete?mac=%s';\">Elimina</button>"), 
-                         device.mac_address.c_str());
-          
-          response->print(F("</div></div></div>"));
-        }
+      char cookie[96];
+      snprintf(cookie, sizeof(cookie), "%s=; Path=/; HttpOnly; SameSite=Strict; Max-Age=0", SESSION_COOKIE_NAME);
+      AsyncWebServerResponse *response = request->beginResponse(302);
+      response->addHeader("Location", "/login");
+      response->addHeader("Set-Cookie", cookie);
+      request->send(response);
+    });
+    
+    // Pagina principale: generata a pezzi con una risposta chunked, leggendo
+    // i dispositivi dal registro solo quando c'è spazio nel buffer TCP
+    App.get_web_server()->on("/", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_PAGE);
+      if (!admit_(request, COST_READ)) {
+        return;
+      }
+      if (!check_auth_(request)) {
+        return request->redirect("/login");
       }
       
-      // Form per aggiungere un nuovo dispositivo
-      response->print(F("<div class=\"add-form\"><h2>Aggiungi Dispositivo</h2>"));
-      response->print(F("<form action=\"/add\" method=\"get\">"));
-      response->print(F("<input type=\"text\" name=\"mac\" placeholder=\"Indirizzo MAC (XX:XX:XX:XX:XX:XX)\" required>"));
-      response->print(F("<input type=\"text\" name=\"name\" placeholder=\"Nome dispositivo\" required>"));
-      response->print(F("<select name=\"action\">"));
-      response->print(F("<option value=\"\">Nessuna azione</option>"));
-      response->print(F("<option value=\"toggle_relay\">Toggle Relè</option>"));
-      response->print(F("<option value=\"turn_on_relay\">Accendi Relè</option>"));
-      response->print(F("<option value=\"turn_off_relay\">Spegni Relè</option>"));
-      response->print(F("</select>"));
-      response->print(F("<button type=\"submit\">Aggiungi</button>"));
-      response->print(F("</form></div>"));
+      DevicePageQuery query;
+      if (request->hasParam("offset")) {
+        query.offset = request->getParam("offset")->value().toInt();
+      }
+      if (request->hasParam("limit")) {
+        long limit = request->getParam("limit")->value().toInt();
+        if (limit > 0) {
+          query.limit = std::min<uint32_t>(limit, DevicePageQuery::MAX_LIMIT);
+        }
+      }
+      if (request->hasParam("authorized") && request->getParam("authorized")->value().length() > 0) {
+        query.authorized = request->getParam("authorized")->value().toInt() ? 1 : 0;
+      }
+      if (request->hasParam("recent")) {
+        query.seen_within = request->getParam("recent")->value().toInt();
+      }
+      if (request->hasParam("prefix")) {
+        query.name_prefix = request->getParam("prefix")->value().c_str();
+      }
       
-      response->print(F("</div></body></html>"));
+      auto stream = std::make_shared<DevicePageStream>(device_manager_, query, &card_cache_);
+      AsyncWebServerResponse *response = request->beginChunkedResponse("text/html", 
+          [stream](uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+            BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_PAGE);
+            return stream->fill(buffer, max_len);
+          });
       request->send(response);
     });
     
     // Endpoint per aggiungere un dispositivo
     App.get_web_server()->on("/add", HTTP_GET, [this](AsyncWebServerRequest *request) {
-      if (!request->authenticate("admin", "password")) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_ADD);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      if (!check_auth_(request)) {
         return request->requestAuthentication();
       }
       
@@ -182,7 +200,11 @@ class BLEWebInterface : public Component {
     
     // Endpoint per autorizzare un dispositivo
     App.get_web_server()->on("/authorize", HTTP_GET, [this](AsyncWebServerRequest *request) {
-      if (!request->authenticate("admin", "password")) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_AUTHORIZE);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      if (!check_auth_(request)) {
         return request->requestAuthentication();
       }
       
@@ -201,7 +223,11 @@ class BLEWebInterface : public Component {
     
     // Endpoint per autorizzazione temporanea (24 ore)
     App.get_web_server()->on("/authorize_temp", HTTP_GET, [this](AsyncWebServerRequest *request) {
-      if (!request->authenticate("admin", "password")) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_AUTHORIZE);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      if (!check_auth_(request)) {
         return request->requestAuthentication();
       }
       
@@ -221,7 +247,11 @@ class BLEWebInterface : public Component {
     
     // Endpoint per revocare l'autorizzazione
     App.get_web_server()->on("/revoke", HTTP_GET, [this](AsyncWebServerRequest *request) {
-      if (!request->authenticate("admin", "password")) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_REVOKE);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      if (!check_auth_(request)) {
         return request->requestAuthentication();
       }
       
@@ -240,7 +270,11 @@ class BLEWebInterface : public Component {
     
     // Endpoint per eliminare un dispositivo
     App.get_web_server()->on("/delete", HTTP_GET, [this](AsyncWebServerRequest *request) {
-      if (!request->authenticate("admin", "password")) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_DELETE);
+      if (!admit_(request, COST_WRITE)) {
+        return;
+      }
+      if (!check_auth_(request)) {
         return request->requestAuthentication();
       }
       
@@ -256,6 +290,566 @@ class BLEWebInterface : public Component {
         request->send(400, "text/plain", "Parametro MAC mancante");
       }
     });
+    
+    // Storico RSSI di un dispositivo (JSON, oppure binario compatto con format=bin)
+    App.get_web_server()->on("/api/history", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_HISTORY);
+      if (!admit_(request, COST_READ)) {
+        return;
+      }
+      if (!check_auth_(request)) {
+        return request->requestAuthentication();
+      }
+      
+      if (!request->hasParam("mac")) {
+        request->send(400, "text/plain", "Parametro MAC mancante");
+        return;
+      }
+      
+      std::string mac = normalize_mac(request->getParam("mac")->value().c_str());
+      if (mac.empty()) {
+        request->send(400, "text/plain", "MAC non valido");
+        return;
+      }
+      std::lock_guard<std::recursive_mutex> lock(device_manager_->get_mutex());
+      const RSSIHistory *history = device_manager_->get_rssi_history(mac);
+      if (history == nullptr) {
+        request->send(404, "text/plain", "Nessuno storico per il dispositivo");
+        return;
+      }
+      
+      if (request->hasParam("format") && request->getParam("format")->value() == "bin") {
+        std::string encoded;
+        history->encode(&encoded);
+        AsyncResponseStream *response = request->beginResponseStream("application/octet-stream");
+        response->write(reinterpret_cast<const uint8_t *>(encoded.data()), encoded.size());
+        request->send(response);
+        return;
+      }
+      
+      uint32_t samples = history->sample_count();
+      uint32_t bytes = history->bytes_used();
+      
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      response->printf(F("{\"mac\":\"%s\",\"sample_count\":%u,\"bytes\":%u,\"bytes_per_sample\":%.2f,"), 
+                       mac.c_str(), samples, bytes, samples > 0 ? (float) bytes / samples : 0.0f);
+      
+      // Medie per minuto e campioni recenti come coppie [tempo, rssi]
+      bool first = true;
+      response->print(F("\"minutes\":["));
+      history->for_each([&](uint32_t time, int8_t rssi, bool per_minute) {
+        if (!per_minute) return;
+        response->printf(F("%s[%u,%d]"), first ? "" : ",", time, rssi);
+        first = false;
+      });
+      
+      first = true;
+      response->print(F("],\"samples\":["));
+      history->for_each([&](uint32_t time, int8_t rssi, bool per_minute) {
+        if (per_minute) return;
+        response->printf(F("%s[%u,%d]"), first ? "" : ",", time, rssi);
+        first = false;
+      });
+      response->print(F("]}"));
+      request->send(response);
+    });
+    
+    // Elenco dispositivi in JSON con sincronizzazione incrementale:
+    // con since=<rev>&epoch=<epoch> restituisce solo i record modificati ed eliminati dopo rev.
+    // L'ETag corrisponde alla revisione del registro, quindi una richiesta con
+    // If-None-Match aggiornato riceve 304 senza serializzare nulla: la
+    // risposta contiene solo campi che cambiano con la revisione (le
+    // rilevazioni e il tempo alla scadenza sono in /api/presence).
+    App.get_web_server()->on("/api/devices", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_DEVICES);
+      if (!admit_(request, COST_READ)) {
+        return;
+      }
+      if (!check_auth_(request)) {
+        return request->requestAuthentication();
+      }
+      
+      std::lock_guard<std::recursive_mutex> lock(device_manager_->get_mutex());
+      
+      char etag[24];
+      snprintf(etag, sizeof(etag), "\"%08x-%u\"", device_manager_->get_epoch(), device_manager_->get_revision());
+      
+      if (request->hasHeader("If-None-Match") && 
+          strcmp(request->getHeader("If-None-Match")->value().c_str(), etag) == 0) {
+        AsyncWebServerResponse *not_modified = request->beginResponse(304);
+        not_modified->addHeader("ETag", etag);
+        request->send(not_modified);
+        return;
+      }
+      
+      // Sincronizzazione incrementale solo se la revisione appartiene
+      // all'avvio corrente (epoch obbligatorio) e le eliminazioni intermedie
+      // sono ancora note
+      bool full = true;
+      uint32_t since = 0;
+      if (request->hasParam("since") && request->hasParam("epoch")) {
+        since = request->getParam("since")->value().toInt();
+        uint32_t epoch = strtoul(request->getParam("epoch")->value().c_str(), nullptr, 16);
+        full = !device_manager_->can_sync_since(epoch, since);
+      }
+      if (full) {
+        since = 0;
+      }
+      
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      response->addHeader("ETag", etag);
+      response->printf(F("{\"epoch\":\"%08x\",\"revision\":%u,\"full\":%s,\"devices\":["), 
+                       device_manager_->get_epoch(), device_manager_->get_revision(), full ? "true" : "false");
+      
+      bool first = true;
+      for (const auto *device : device_manager_->get_devices_changed_since(since)) {
+        if (!first) response->print(F(","));
+        print_device_json_(response, *device);
+        first = false;
+      }
+      
+      response->print(F("],\"deleted\":["));
+      first = true;
+      if (!full) {
+        for (const auto &deleted : device_manager_->get_deleted_devices()) {
+          if (deleted.revision <= since) continue;
+          response->printf(F("%s\"%s\""), first ? "" : ",", deleted.mac_address.c_str());
+          first = false;
+        }
+      }
+      response->print(F("]}"));
+      request->send(response);
+    });
+    
+    // Dati volatili dei dispositivi (ultima rilevazione e tempo alla
+    // scadenza), che non modificano la revisione: nessun ETag
+    App.get_web_server()->on("/api/presence", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_DEVICES);
+      if (!admit_(request, COST_READ)) {
+        return;
+      }
+      if (!check_auth_(request)) {
+        return request->requestAuthentication();
+      }
+      
+      std::lock_guard<std::recursive_mutex> lock(device_manager_->get_mutex());
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      response->addHeader("Cache-Control", "no-store");
+      response->printf(F("{\"uptime\":%u,\"devices\":["), millis() / 1000);
+      bool first = true;
+      for (const auto &device : device_manager_->get_all_devices()) {
+        response->printf(F("%s{\"mac\":\"%s\",\"expires_in\":%u,\"last_seen\":%u,\"last_rssi\":%d}"),
+                         first ? "" : ",", device.mac_address.c_str(), device_manager_->get_expires_in(device),
+                         device.last_seen, device.last_rssi);
+        first = false;
+      }
+      response->print(F("]}"));
+      request->send(response);
+    });
+    
+    // Contatori del limitatore e delle sessioni in formato testo (Prometheus)
+    App.get_web_server()->on("/api/metrics", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_METRICS);
+      if (!admit_(request, COST_READ)) {
+        return;
+      }
+      if (!check_auth_(request)) {
+        return request->requestAuthentication();
+      }
+      
+      std::lock_guard<std::recursive_mutex> lock(device_manager_->get_mutex());
+      AsyncResponseStream *response = request->beginResponseStream("text/plain");
+      response->printf(F("blekm_http_admitted_total %u\n"), rate_limiter_.get_admitted());
+      response->printf(F("blekm_http_rejected_total{reason=\"client\"} %u\n"), rate_limiter_.get_rejected_client());
+      response->printf(F("blekm_http_rejected_total{reason=\"global\"} %u\n"), rate_limiter_.get_rejected_global());
+      response->printf(F("blekm_http_rejected_total{reason=\"busy\"} %u\n"), rate_limiter_.get_rejected_busy());
+      response->printf(F("blekm_http_client_evictions_total %u\n"), rate_limiter_.get_client_evictions());
+      response->printf(F("blekm_http_in_flight %u\n"), rate_limiter_.get_in_flight());
+      response->printf(F("blekm_http_in_flight_peak %u\n"), rate_limiter_.get_peak_in_flight());
+      response->printf(F("blekm_session_cache_hits_total %u\n"), sessions_.get_cache_hits());
+      response->printf(F("blekm_session_cache_misses_total %u\n"), sessions_.get_cache_misses());
+      response->printf(F("blekm_ingest_pushed_total %u\n"), device_manager_->get_ingest_pushed());
+      response->printf(F("blekm_ingest_dropped_total %u\n"), device_manager_->get_ingest_dropped());
+      response->printf(F("blekm_ingest_deduplicated_total %u\n"), device_manager_->get_ingest_deduplicated());
+      response->printf(F("blekm_ingest_applied_total %u\n"), device_manager_->get_ingest_applied());
+      response->printf(F("blekm_ingest_peak_depth %u\n"), static_cast<unsigned>(device_manager_->get_ingest_peak_depth()));
+      response->printf(F("blekm_card_cache_hits_total %u\n"), card_cache_.get_hits());
+      response->printf(F("blekm_card_cache_misses_total %u\n"), card_cache_.get_misses());
+      response->printf(F("blekm_card_cache_evictions_total %u\n"), card_cache_.get_evictions());
+      response->printf(F("blekm_card_cache_bytes %u\n"), static_cast<unsigned>(card_cache_.get_used()));
+      response->printf(F("blekm_card_cache_entries %u\n"), static_cast<unsigned>(card_cache_.get_entries()));
+      const RollingCodeVerifier &verifier = device_manager_->get_rolling_verifier();
+      response->printf(F("blekm_rolling_accepted_total %u\n"), verifier.get_accepted());
+      response->printf(F("blekm_rolling_rejected_total{reason=\"replay\"} %u\n"), verifier.get_rejected_replay());
+      response->printf(F("blekm_rolling_rejected_total{reason=\"tag\"} %u\n"), verifier.get_rejected_tag());
+      response->printf(F("blekm_rolling_rejected_total{reason=\"window\"} %u\n"), verifier.get_rejected_window());
+      response->printf(F("blekm_rolling_tracked_total %u\n"), verifier.get_tracked());
+      const FusionLink *fusion = device_manager_->get_fusion_link();
+      if (fusion != nullptr) {
+        response->printf(F("blekm_fusion_packets_sent_total %u\n"), fusion->get_packets_sent());
+        response->printf(F("blekm_fusion_bytes_sent_total %u\n"), fusion->get_bytes_sent());
+        response->printf(F("blekm_fusion_send_errors_total %u\n"), fusion->get_send_errors());
+        response->printf(F("blekm_fusion_packets_received_total %u\n"), fusion->get_packets_received());
+        response->printf(F("blekm_fusion_unknown_sources_total %u\n"), fusion->get_unknown_sources());
+        response->printf(F("blekm_fusion_packets_rejected_total %u\n"), device_manager_->get_fusion_rejected_packets());
+        response->printf(F("blekm_fusion_foreign_sightings_total %u\n"), device_manager_->get_fusion_foreign_sightings());
+      }
+      const JournalStore *journal = device_manager_->get_journal();
+      if (journal != nullptr) {
+        response->printf(F("blekm_journal_records_total %u\n"), journal->get_records_written());
+        response->printf(F("blekm_journal_bytes_total %u\n"), journal->get_bytes_written());
+        response->printf(F("blekm_journal_sector_erases_total %u\n"), journal->get_sectors_erased());
+        response->printf(F("blekm_journal_write_errors_total %u\n"), journal->get_write_errors());
+        response->printf(F("blekm_journal_dropped_total %u\n"), device_manager_->get_journal_dropped());
+        response->printf(F("blekm_journal_live_sectors %u\n"), static_cast<unsigned>(journal->get_live_sectors()));
+        response->printf(F("blekm_journal_sectors %u\n"), static_cast<unsigned>(journal->get_sector_count()));
+      }
+      if (AllocTracker::get_free_heap() != 0) {
+        response->printf(F("blekm_heap_free_bytes %u\n"), AllocTracker::get_free_heap());
+        response->printf(F("blekm_heap_min_free_bytes %u\n"), AllocTracker::get_min_free_heap());
+        response->printf(F("blekm_heap_largest_free_block_bytes %u\n"), AllocTracker::get_largest_free_block());
+      }
+      if (AllocTracker::is_enabled()) {
+        response->printf(F("blekm_alloc_current_bytes %u\n"), AllocTracker::get_current_bytes());
+        response->printf(F("blekm_alloc_peak_bytes %u\n"), AllocTracker::get_peak_bytes());
+        for (uint8_t site = 0; site < ALLOC_SITE_COUNT; site++) {
+          AllocSiteStats stats = AllocTracker::get_site_stats(static_cast<AllocSite>(site));
+          const char *name = alloc_site_name(static_cast<AllocSite>(site));
+          response->printf(F("blekm_alloc_total{site=\"%s\"} %u\n"), name, stats.allocations);
+          response->printf(F("blekm_alloc_bytes_total{site=\"%s\"} %u\n"), name, stats.bytes);
+          response->printf(F("blekm_alloc_current_bytes{site=\"%s\"} %u\n"), name, stats.current_bytes);
+          response->printf(F("blekm_alloc_peak_bytes{site=\"%s\"} %u\n"), name, stats.peak_bytes);
+        }
+      }
+      request->send(response);
+    });
+    
+    // Esportazione del registro in CSV (predefinito) o binario compatto (format=bin)
+    App.get_web_server()->on("/api/export", HTTP_GET, [this](AsyncWebServerRequest *request) {
+      BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_EXPORT);
+      if (!admit_(request, COST_BULK)) {
+        return;
+      }
+      if (!check_auth_(request)) {
+        return request->requestAuthentication();
+      }
+      
+      bool binary = request->hasParam("format") && request->getParam("format")->value() == "bin";
+      auto stream = std::make_shared<RegistryExportStream>(device_manager_, binary);
+      AsyncWebServerResponse *response = request->beginChunkedResponse(
+          binary ? "application/octet-stream" : "text/csv", 
+          [stream](uint8_t *buffer, size_t max_len, size_t index) -> size_t {
+            BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_EXPORT);
+            return stream->fill(buffer, max_len);
+          });
+      response->addHeader("Content-Disposition", binary ? "attachment; filename=\"ble_devices.bin\"" 
+                                                        : "attachment; filename=\"ble_devices.csv\"");
+      request->send(response);
+    });
+    
+    // Importazione del registro: il corpo (CSV o binario con format=bin) viene
+    // analizzato man mano che arriva e applicato in un'unica transazione solo
+    // se tutte le righe sono valide
+    App.get_web_server()->on("/api/import", HTTP_POST, 
+        [this](AsyncWebServerRequest *request) {
+          BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_IMPORT);
+          if (take_rejected_body_(request)) {
+            return; // Risposta già inviata alla ricezione del corpo
+          }
+          if (import_request_ != request || !importer_) {
+            // Richiesta senza corpo: i controlli non sono ancora stati fatti
+            if (!admit_(request, COST_BULK)) {
+              return;
+            }
+            if (!check_auth_(request)) {
+              return request->requestAuthentication();
+            }
+            request->send(400, "text/plain", "Dati da importare mancanti");
+            return;
+          }
+          
+          importer_->finish();
+          bool valid = importer_->error_count() == 0;
+          bool full = valid && !device_manager_->import_records(importer_->records());
+          valid = valid && !full;
+          
+          AsyncResponseStream *response = request->beginResponseStream("application/json");
+          response->setCode(valid ? 200 : 400);
+          response->printf(F("{\"applied\":%s,\"records\":%u,\"error_count\":%u,\"errors\":["), 
+                           valid ? "true" : "false", (unsigned) importer_->records().size(), 
+                           full ? 1u : importer_->error_count());
+          bool first = true;
+          if (full) {
+            response->print(F("{\"line\":0,\"error\":\"Registro pieno\"}"));
+            first = false;
+          }
+          for (const auto &error : importer_->errors()) {
+            response->printf(F("%s{\"line\":%u,\"error\":\"%s\"}"), first ? "" : ",", error.line, error.message);
+            first = false;
+          }
+          response->print(F("]}"));
+          request->send(response);
+          
+          importer_.reset();
+          import_request_ = nullptr;
+        },
+        nullptr,
+        [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+          BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_IMPORT);
+          if (index == 0) {
+            // Il corpo di richieste rifiutate viene ignorato senza analizzarlo
+            if (reject_body_(request, importer_ != nullptr, "Importazione già in corso")) {
+              return;
+            }
+            bool binary = request->hasParam("format") && request->getParam("format")->value() == "bin";
+            importer_.reset(new RegistryImporter(binary));
+            import_request_ = request;
+          }
+          
+          if (import_request_ == request) {
+            importer_->feed(data, len);
+          }
+        });
+    
+    // Gruppo di operazioni (una per riga) applicate in modo atomico con un
+    // solo salvataggio: se un'operazione fallisce non viene applicato nulla
+    App.get_web_server()->on("/api/batch", HTTP_POST, 
+        [this](AsyncWebServerRequest *request) {
+          BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_BATCH);
+          if (take_rejected_body_(request)) {
+            return;
+          }
+          if (batch_request_ != request || !batch_reader_) {
+            if (!admit_(request, COST_BULK)) {
+              return;
+            }
+            if (!check_auth_(request)) {
+              return request->requestAuthentication();
+            }
+            request->send(400, "text/plain", "Operazioni mancanti");
+            return;
+          }
+          
+          batch_reader_->finish();
+          if (batch_reader_->too_many()) {
+            batch_reader_.reset();
+            batch_request_ = nullptr;
+            request->send(413, "text/plain", "Troppe operazioni");
+            return;
+          }
+          
+          std::vector<const char *> errors;
+          bool applied = device_manager_->apply_batch(batch_reader_->operations(), &errors);
+          
+          AsyncResponseStream *response = request->beginResponseStream("application/json");
+          response->setCode(applied ? 200 : 400);
+          response->printf(F("{\"applied\":%s,\"results\":["), applied ? "true" : "false");
+          for (size_t i = 0; i < errors.size(); i++) {
+            if (errors[i] == nullptr) {
+              response->printf(F("%s{\"op\":%u,\"ok\":true}"), i > 0 ? "," : "", (unsigned) i);
+            } else {
+              response->printf(F("%s{\"op\":%u,\"ok\":false,\"error\":\"%s\"}"), 
+                               i > 0 ? "," : "", (unsigned) i, errors[i]);
+            }
+          }
+          response->print(F("]}"));
+          request->send(response);
+          
+          batch_reader_.reset();
+          batch_request_ = nullptr;
+        },
+        nullptr,
+        [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+          BLE_KEY_MANAGER_ALLOC_SCOPE(ALLOC_SITE_HTTP_BATCH);
+          if (index == 0) {
+            if (reject_body_(request, batch_reader_ != nullptr, "Gruppo di operazioni già in corso")) {
+              return;
+            }
+            batch_reader_.reset(new BatchReader());
+            batch_request_ = request;
+          }
+          
+          if (batch_request_ == request) {
+            batch_reader_->feed(data, len);
+          }
+        });
+  }
+  
+  // Applica i limiti di frequenza prima di qualsiasi altra elaborazione.
+  // Le richieste oltre il limite ricevono subito un 429 senza corpo da generare.
+  bool admit_(AsyncWebServerRequest *request, uint32_t cost) {
+    uint32_t ip = request->client() != nullptr ? (uint32_t) request->client()->remoteIP() : 0;
+    RateLimiter::Result result = rate_limiter_.admit(ip, request, millis(), cost);
+    if (result == RateLimiter::ADMITTED) {
+      request->onDisconnect([this, request]() { on_request_end_(request); });
+      return true;
+    }
+    
+    AsyncWebServerResponse *response = request->beginResponse(429, "text/plain", 
+        result == RateLimiter::BUSY ? "Server occupato" : "Troppe richieste");
+    response->addHeader("Retry-After", "1");
+    request->send(response);
+    return false;
+  }
+  
+  // Controlli di /api/import e /api/batch, fatti alla ricezione del primo
+  // pezzo del corpo prima di analizzarlo: limiti di frequenza,
+  // autenticazione e operazione già in corso (busy). Se la richiesta viene
+  // rifiutata la risposta parte subito, il resto del corpo viene scartato e
+  // true indica all'handler finale di non rispondere di nuovo.
+  bool reject_body_(AsyncWebServerRequest *request, bool busy, const char *busy_message) {
+    if (admit_(request, COST_BULK)) {
+      if (!check_auth_(request)) {
+        request->requestAuthentication();
+      } else if (busy) {
+        request->send(409, "text/plain", busy_message);
+      } else {
+        return false;
+      }
+    } else {
+      request->onDisconnect([this, request]() { on_request_end_(request); });
+    }
+    rejected_bodies_.push_back(request);
+    return true;
+  }
+  
+  // Indica se la richiesta era stata rifiutata da reject_body_ e la dimentica
+  bool take_rejected_body_(AsyncWebServerRequest *request) {
+    auto it = std::find(rejected_bodies_.begin(), rejected_bodies_.end(), request);
+    if (it == rejected_bodies_.end()) {
+      return false;
+    }
+    rejected_bodies_.erase(it);
+    return true;
+  }
+  
+  // Chiamato alla chiusura di una richiesta: libera lo slot del limitatore
+  // e l'eventuale importazione o gruppo di operazioni rimasto incompleto
+  void on_request_end_(AsyncWebServerRequest *request) {
+    rate_limiter_.release(request);
+    take_rejected_body_(request);
+    if (import_request_ == request) {
+      importer_.reset();
+      import_request_ = nullptr;
+    }
+    if (batch_request_ == request) {
+      batch_reader_.reset();
+      batch_request_ = nullptr;
+    }
+  }
+  
+  // Verifica l'accesso: cookie di sessione valido oppure credenziali Basic
+  // (per client come curl che non gestiscono i cookie)
+  bool check_auth_(AsyncWebServerRequest *request) {
+    std::string token = get_session_cookie_(request);
+    if (!token.empty() && sessions_.validate(token.c_str(), token.size(), millis() / 1000)) {
+      return true;
+    }
+    return !password_.empty() && request->authenticate(username_.c_str(), password_.c_str());
+  }
+  
+  // Estrae il token di sessione dall'header Cookie (stringa vuota se assente)
+  std::string get_session_cookie_(AsyncWebServerRequest *request) {
+    if (!request->hasHeader("Cookie")) {
+      return "";
+    }
+    std::string cookies = request->getHeader("Cookie")->value().c_str();
+    std::string prefix = std::string(SESSION_COOKIE_NAME) + "=";
+    size_t pos = 0;
+    while (pos < cookies.size()) {
+      while (pos < cookies.size() && cookies[pos] == ' ') pos++;
+      size_t end = cookies.find(';', pos);
+      if (end == std::string::npos) end = cookies.size();
+      if (cookies.compare(pos, prefix.size(), prefix) == 0) {
+        return cookies.substr(pos + prefix.size(), end - pos - prefix.size());
+      }
+      pos = end + 1;
+    }
+    return "";
+  }
+  
+  // Confronta le credenziali a tempo costante: vengono confrontati gli hash,
+  // così la durata non dipende né dal contenuto né dalla lunghezza
+  bool credentials_match_(const char *username, const char *password) {
+    if (password_.empty()) {
+      return false;
+    }
+    uint8_t expected[SHA256::DIGEST_SIZE], received[SHA256::DIGEST_SIZE];
+    SHA256 hash;
+    hash.update(reinterpret_cast<const uint8_t *>(username_.c_str()), username_.size() + 1);
+    hash.update(reinterpret_cast<const uint8_t *>(password_.c_str()), password_.size());
+    hash.finish(expected);
+    hash.reset();
+    hash.update(reinterpret_cast<const uint8_t *>(username), strlen(username) + 1);
+    hash.update(reinterpret_cast<const uint8_t *>(password), strlen(password));
+    hash.finish(received);
+    return constant_time_equal(expected, received, SHA256::DIGEST_SIZE);
+  }
+  
+  // Genera una nuova chiave per le sessioni
+  void rotate_session_secret_() {
+    uint8_t secret[32];
+    for (size_t i = 0; i < sizeof(secret); i += 4) {
+      uint32_t value = random_uint32();
+      memcpy(secret + i, &value, 4);
+    }
+    sessions_.set_secret(secret, sizeof(secret));
+  }
+  
+  void send_login_page_(AsyncWebServerRequest *request, bool failed) {
+    AsyncResponseStream *response = request->beginResponseStream("text/html");
+    if (failed) {
+      response->setCode(401);
+    }
+    response->print(F("<!DOCTYPE html><html><head>"));
+    response->print(F("<meta charset=\"UTF-8\">"));
+    response->print(F("<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">"));
+    response->print(F("<title>BLE Key Manager - Accesso</title>"));
+    response->print(F("<style>"));
+    response->print(F("body{font-family:Arial,sans-serif;margin:0;padding:20px;line-height:1.6;}"));
+    response->print(F(".card{max-width:360px;margin:40px auto;background:#f9f9f9;border-radius:5px;padding:15px;box-shadow:0 2px 4px rgba(0,0,0,0.1);}"));
+    response->print(F("input{display:block;width:100%;box-sizing:border-box;padding:8px;margin-bottom:10px;border-radius:4px;border:1px solid #ddd;}"));
+    response->print(F("button{background:#4CAF50;color:white;border:none;padding:8px 12px;border-radius:4px;cursor:pointer;}"));
+    response->print(F(".unauthorized{color:red;}"));
+    response->print(F("</style>"));
+    response->print(F("</head><body><div class=\"card\">"));
+    response->print(F("<h1>BLE Key Manager</h1>"));
+    if (failed) {
+      response->print(F("<p class=\"unauthorized\">Credenziali non valide</p>"));
+    }
+    response->print(F("<form method=\"post\" action=\"/login\">"));
+    response->print(F("<input type=\"text\" name=\"username\" placeholder=\"Utente\" required>"));
+    response->print(F("<input type=\"password\" name=\"password\" placeholder=\"Password\" required>"));
+    response->print(F("<button type=\"submit\">Accedi</button>"));
+    response->print(F("</form></div></body></html>"));
+    request->send(response);
+  }
+  
+  // Scrive una stringa JSON con i caratteri speciali in escape
+  void print_json_string_(AsyncResponseStream *response, const std::string &value) {
+    response->print(F("\""));
+    for (char c : value) {
+      if (c == '"' || c == '\\') {
+        response->printf(F("\\%c"), c);
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        response->printf(F("\\u%04x"), c);
+      } else {
+        response->write(static_cast<uint8_t>(c));
+      }
+    }
+    response->print(F("\""));
+  }
+  
+  // Scrive un dispositivo come oggetto JSON
+  void print_device_json_(AsyncResponseStream *response, const BLEDeviceManager::BLEDevice &device) {
+    response->printf(F("{\"mac\":\"%s\",\"name\":"), device.mac_address.c_str());
+    print_json_string_(response, device.name);
+    response->print(F(",\"action\":"));
+    print_json_string_(response, device.action_id);
+    response->printf(F(",\"expires_at\":%u,\"authorized\":%s,\"rolling_code\":%s,\"revision\":%u}"), 
+                     device.expiry_time,
+                     BLEDeviceManager::is_authorized(device, millis() / 1000) ? "true" : "false",
+                     device.rolling_key.empty() ? "false" : "true", device.revision);
   }
 };
 
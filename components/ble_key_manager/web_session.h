@@ -0,0 +1,147 @@
+#pragma once
+
+#include "hmac_sha256.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace esphome {
+
+// Nome del cookie che contiene il token di sessione
+static const char *const SESSION_COOKIE_NAME = "blekm_session";
+
+// Sessioni dell'interfaccia web basate su token firmati con HMAC-SHA256.
+// Un token ha la forma "<scadenza>.<nonce>.<firma>" (esadecimale), dove la
+// firma copre scadenza e nonce con una chiave generata ad ogni avvio: non
+// serve memorizzare le sessioni emesse. I token già verificati vengono
+// tenuti in una piccola cache per evitare di ricalcolare l'HMAC ad ogni
+// richiesta.
+class SessionManager {
+ public:
+  static const size_t CACHE_SIZE = 8;
+  static const size_t REVOKED_SIZE = 8;
+  static const size_t SIGNATURE_BYTES = 16;
+  static const size_t PAYLOAD_LENGTH = 8 + 1 + 8;
+  static const size_t TOKEN_LENGTH = PAYLOAD_LENGTH + 1 + 2 * SIGNATURE_BYTES;
+
+  void set_secret(const uint8_t *key, size_t len) {
+    hmac_.set_key(key, len);
+    memset(cache_, 0, sizeof(cache_));
+    memset(revoked_, 0, sizeof(revoked_));
+  }
+
+  void set_ttl(uint32_t seconds) { ttl_ = seconds; }
+  uint32_t get_ttl() const { return ttl_; }
+
+  // Emette un nuovo token valido per ttl secondi a partire da now
+  std::string issue(uint32_t now, uint32_t nonce) {
+    char token[TOKEN_LENGTH + 1];
+    snprintf(token, sizeof(token), "%08x.%08x.", now + ttl_, nonce);
+    sign_(token, token + PAYLOAD_LENGTH + 1);
+    token[TOKEN_LENGTH] = '\0';
+    return std::string(token, TOKEN_LENGTH);
+  }
+
+  // Verifica un token; true se la firma è corretta e non è scaduto o revocato
+  bool validate(const char *token, size_t len, uint32_t now) {
+    if (len != TOKEN_LENGTH || token[8] != '.' || token[PAYLOAD_LENGTH] != '.') {
+      return false;
+    }
+    uint32_t expiry = parse_expiry_(token);
+    if (expiry <= now) {
+      return false;
+    }
+
+    // Token già verificato
+    for (auto &entry : cache_) {
+      if (entry.expiry > now && constant_time_equal(reinterpret_cast<const uint8_t *>(entry.token),
+                                                    reinterpret_cast<const uint8_t *>(token), TOKEN_LENGTH)) {
+        cache_hits_++;
+        return true;
+      }
+    }
+
+    for (auto &entry : revoked_) {
+      if (entry.expiry > now && constant_time_equal(reinterpret_cast<const uint8_t *>(entry.token),
+                                                    reinterpret_cast<const uint8_t *>(token), TOKEN_LENGTH)) {
+        return false;
+      }
+    }
+
+    char signature[2 * SIGNATURE_BYTES];
+    sign_(token, signature);
+    if (!constant_time_equal(reinterpret_cast<const uint8_t *>(signature),
+                             reinterpret_cast<const uint8_t *>(token + PAYLOAD_LENGTH + 1), sizeof(signature))) {
+      return false;
+    }
+
+    // Sostituisce la voce che scade per prima
+    CachedToken *slot = &cache_[0];
+    for (auto &entry : cache_) {
+      if (entry.expiry < slot->expiry) slot = &entry;
+    }
+    memcpy(slot->token, token, TOKEN_LENGTH);
+    slot->expiry = expiry;
+    cache_misses_++;
+    return true;
+  }
+
+  // Revoca un token (logout). Se l'elenco delle revoche è pieno viene
+  // rigenerata la chiave: tutte le sessioni aperte diventano non valide.
+  bool revoke(const char *token, size_t len, uint32_t now) {
+    if (!validate(token, len, now)) {
+      return false;
+    }
+    for (auto &entry : cache_) {
+      if (memcmp(entry.token, token, TOKEN_LENGTH) == 0) {
+        entry.expiry = 0;
+      }
+    }
+    for (auto &entry : revoked_) {
+      if (entry.expiry <= now) {
+        memcpy(entry.token, token, TOKEN_LENGTH);
+        entry.expiry = parse_expiry_(token);
+        return true;
+      }
+    }
+    return false; // Il chiamante deve rigenerare la chiave
+  }
+
+  uint32_t get_cache_hits() const { return cache_hits_; }
+  uint32_t get_cache_misses() const { return cache_misses_; }
+
+ private:
+  struct CachedToken {
+    char token[TOKEN_LENGTH];
+    uint32_t expiry;
+  };
+
+  HMACSHA256 hmac_;
+  uint32_t ttl_ = 900;
+  CachedToken cache_[CACHE_SIZE] = {};
+  CachedToken revoked_[REVOKED_SIZE] = {};
+  uint32_t cache_hits_ = 0;
+  uint32_t cache_misses_ = 0;
+
+  static uint32_t parse_expiry_(const char *token) {
+    char expiry[9];
+    memcpy(expiry, token, 8);
+    expiry[8] = '\0';
+    return strtoul(expiry, nullptr, 16);
+  }
+
+  // Firma la parte "<scadenza>.<nonce>" scrivendo la firma in esadecimale
+  void sign_(const char *payload, char *out) const {
+    static const char HEX[] = "0123456789abcdef";
+    uint8_t digest[SHA256::DIGEST_SIZE];
+    hmac_.sign(reinterpret_cast<const uint8_t *>(payload), PAYLOAD_LENGTH, digest);
+    for (size_t i = 0; i < SIGNATURE_BYTES; i++) {
+      out[2 * i] = HEX[digest[i] >> 4];
+      out[2 * i + 1] = HEX[digest[i] & 0x0F];
+    }
+  }
+};
+
+} // namespace esphome
@@ -0,0 +1,78 @@
+// Scritture sulla flash per tipo di modifica del registro (record, byte e
+// chiamate a write) e costo medio includendo compattazioni e cancellazioni
+
+#include "ble_device_manager.h"
+#include "check.h"
+#include "sim_flash.h"
+#include <cstdio>
+#include <functional>
+
+using namespace esphome;
+
+static const int DEVICES = 200;
+static const std::string KEY(ROLLING_KEY_SIZE, '\x5a');
+
+static std::string badge_mac(int i) {
+  char mac[18];
+  snprintf(mac, sizeof(mac), "AA:BB:CC:DD:%02X:%02X", static_cast<unsigned>((i >> 8) & 0xFF),
+           static_cast<unsigned>(i & 0xFF));
+  return mac;
+}
+
+// Esegue mutation su ogni dispositivo e stampa il costo medio per modifica
+static void measure(const char *name, SimFlash *flash, BLEDeviceManager *manager,
+                    const std::function<void(int)> &mutation, int count = DEVICES) {
+  const JournalStore *journal = manager->get_journal();
+  uint32_t records = journal->get_records_written();
+  uint32_t bytes = flash->bytes_written;
+  uint32_t writes = flash->writes;
+  for (int i = 0; i < count; i++) {
+    mutation(i);
+  }
+  CHECK(manager->get_journal_dropped() == 0);
+  printf("%-26s %5.2f record  %6.1f byte  %5.2f write\n", name,
+         (double) (journal->get_records_written() - records) / count, (double) (flash->bytes_written - bytes) / count,
+         (double) (flash->writes - writes) / count);
+}
+
+int main() {
+  fake_ms() = 2000;
+  SimFlash flash(4096, 32);  // Come la partizione blekm di partitions.csv
+  BLEDeviceManager manager;
+  manager.set_flash_device(&flash);
+  manager.setup();
+
+  printf("Costo per modifica (%d dispositivi, senza compattazione):\n", DEVICES);
+  measure("aggiunta", &flash, &manager, [&](int i) { manager.add_device(badge_mac(i), "Badge ufficio", "apri"); });
+  measure("autorizzazione", &flash, &manager, [&](int i) { manager.authorize_device(badge_mac(i)); });
+  measure("autorizzazione 24 h", &flash, &manager, [&](int i) { manager.authorize_device(badge_mac(i), 86400); });
+  measure("revoca", &flash, &manager, [&](int i) { manager.revoke_authorization(badge_mac(i)); });
+  measure("cambio azione", &flash, &manager, [&](int i) { manager.set_device_action(badge_mac(i), "chiudi"); });
+  measure("chiave a codice variabile", &flash, &manager, [&](int i) { manager.set_device_key(badge_mac(i), KEY); });
+  measure("gruppo di 10 revoche", &flash, &manager, [&](int i) {
+    std::vector<BatchOperation> operations(10);
+    for (int j = 0; j < 10; j++) {
+      operations[j].type = BatchOperation::REVOKE;
+      operations[j].mac_address = badge_mac((i * 10 + j) % DEVICES);
+    }
+    std::vector<const char *> errors;
+    manager.apply_batch(operations, &errors);
+  }, DEVICES / 10);
+  measure("eliminazione", &flash, &manager, [&](int i) { manager.remove_device(badge_mac(i)); }, DEVICES / 2);
+
+  // Funzionamento prolungato: compattazioni e cancellazioni comprese
+  const int mutations = 100000;
+  const JournalStore *journal = manager.get_journal();
+  uint32_t bytes = flash.bytes_written;
+  uint32_t erases = flash.erases;
+  for (int i = 0; i < mutations; i++) {
+    manager.set_device_action(badge_mac(DEVICES / 2 + i % (DEVICES / 2)), i % 2 ? "apri" : "chiudi");
+    fake_ms() += 100;
+    manager.loop();
+  }
+  CHECK(manager.get_journal_dropped() == 0);
+  CHECK(journal->get_write_errors() == 0);
+  printf("%d cambi di azione: %.1f byte/modifica, %.2f cancellazioni ogni 1000 modifiche\n", mutations,
+         (double) (flash.bytes_written - bytes) / mutations, 1000.0 * (flash.erases - erases) / mutations);
+  return 0;
+}
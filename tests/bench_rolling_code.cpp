@@ -0,0 +1,52 @@
+// Verifiche di token al secondo per esito: i token ripetuti e fuori
+// finestra vengono scartati prima dell'HMAC
+
+#include "rolling_code.h"
+#include "check.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+using namespace esphome;
+
+static const uint8_t KEY[ROLLING_KEY_SIZE] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+static const uint8_t MAC[6] = {0xAA, 0xBB, 0xCC, 0x00, 0x00, 0x01};
+static const int COUNT = 200000;
+
+template<typename F> static void measure(const char *name, F verify) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 1; i <= COUNT; i++) {
+    verify(static_cast<uint32_t>(i));
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-22s %10.0f verifiche/s\n", name, COUNT / elapsed);
+}
+
+int main() {
+  // Token validi preparati prima, per misurare solo la verifica
+  std::vector<RollingToken> tokens(COUNT + 1);
+  for (int i = 1; i <= COUNT; i++) {
+    tokens[i].counter = i;
+    compute_rolling_tag(KEY, sizeof(KEY), MAC, i, tokens[i].tag);
+  }
+
+  RollingCodeVerifier verifier;
+  uint32_t last = 0;
+  measure("validi", [&](uint32_t i) { CHECK(verifier.verify(KEY, sizeof(KEY), MAC, tokens[i], &last) == ROLLING_OK); });
+  measure("ripetuti", [&](uint32_t i) { verifier.verify(KEY, sizeof(KEY), MAC, tokens[i], &last); });
+  measure("fuori finestra", [&](uint32_t i) {
+    RollingToken token = tokens[i];
+    token.counter = last + ROLLING_COUNTER_WINDOW + i;
+    verifier.verify(KEY, sizeof(KEY), MAC, token, &last);
+  });
+  measure("firma errata", [&](uint32_t i) {
+    RollingToken token = tokens[i];
+    token.counter = last + 1 + (i % ROLLING_COUNTER_WINDOW);
+    token.tag[0] ^= static_cast<uint8_t>(i);
+    verifier.verify(KEY, sizeof(KEY), MAC, token, &last);
+  });
+  last = 0;
+  measure("seguiti (track)", [&](uint32_t i) { verifier.track(KEY, sizeof(KEY), MAC, tokens[i], &last, true); });
+  CHECK(verifier.get_accepted() == COUNT);
+  return 0;
+}
@@ -0,0 +1,54 @@
+// Byte per campione dello storico RSSI con alcuni andamenti tipici e costo
+// di add_sample()
+
+#include "rssi_history.h"
+#include "check.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace esphome;
+
+struct Pattern {
+  const char *name;
+  uint32_t interval;  // Secondi tra due campioni
+  int step;           // Variazione massima dell'RSSI tra due campioni
+};
+
+int main() {
+  const Pattern patterns[] = {
+      {"fermo, 1 s", 1, 1},
+      {"in movimento, 1 s", 1, 6},
+      {"in movimento, 5 s", 5, 6},
+      {"rumoroso, 30 s", 30, 40},
+      {"sporadico, 5 min", 300, 10},
+  };
+  srand(1);
+  for (const auto &pattern : patterns) {
+    RSSIHistory history;
+    uint32_t time = 1000;
+    int rssi = -65;
+    for (int i = 0; i < 10000; i++) {
+      time += pattern.interval;
+      rssi += rand() % (2 * pattern.step + 1) - pattern.step;
+      rssi = rssi < -100 ? -100 : (rssi > -30 ? -30 : rssi);
+      history.add_sample(time, rssi);
+    }
+    std::string encoded;
+    history.encode(&encoded);
+    CHECK(history.sample_count() > 0);
+    printf("%-20s %4u campioni in %3u byte: %.2f byte/campione (binario: %.2f)\n", pattern.name,
+           history.sample_count(), history.bytes_used(), (double) history.bytes_used() / history.sample_count(),
+           (double) encoded.size() / history.sample_count());
+  }
+
+  RSSIHistory history;
+  const int samples = 2000000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < samples; i++) {
+    history.add_sample(i, -60 - (i & 7));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("add_sample: %.0f ns/campione\n", seconds * 1e9 / samples);
+  return 0;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+// Sostituto minimo di esphome.h per compilare le prove su PC: solo le parti
+// di ESPHome e di ESPAsyncWebServer usate dal componente. millis() restituisce
+// un tempo impostato dalle prove con fake_ms().
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define F(x) x
+#define ESP_LOGD(tag, ...) do {} while (0)
+#define ESP_LOGI(tag, ...) do {} while (0)
+#define ESP_LOGW(tag, ...) do {} while (0)
+#define ESP_LOGE(tag, ...) do {} while (0)
+#define ESP_LOGCONFIG(tag, ...) do {} while (0)
+
+inline std::atomic<uint32_t> &fake_ms() {
+  static std::atomic<uint32_t> value{0};
+  return value;
+}
+inline uint32_t millis() { return fake_ms().load(); }
+inline uint32_t micros() { return fake_ms().load() * 1000; }
+
+namespace esphome {
+
+inline uint32_t random_uint32() { return static_cast<uint32_t>(rand()); }
+
+class Component {
+ public:
+  virtual ~Component() {}
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual void dump_config() {}
+  virtual float get_setup_priority() const { return 0; }
+  void status_set_warning(const char *message = "unspecified") { warning_ = true; }
+  void status_clear_warning() { warning_ = false; }
+  bool status_has_warning() const { return warning_; }
+
+ protected:
+  bool warning_ = false;
+};
+
+namespace setup_priority {
+const float DATA = 600.0f;
+const float LATE = -100.0f;
+} // namespace setup_priority
+
+namespace sensor {
+class Sensor {
+ public:
+  float state = 0;
+  bool has_state() const { return has_state_; }
+  void publish_state(float value) {
+    state = value;
+    has_state_ = true;
+  }
+
+ private:
+  bool has_state_ = false;
+};
+} // namespace sensor
+
+} // namespace esphome
+
+struct String {
+  std::string s;
+  String() {}
+  String(const char *c) : s(c) {}
+  String(const std::string &x) : s(x) {}
+  const char *c_str() const { return s.c_str(); }
+  long toInt() const { return atol(s.c_str()); }
+  size_t length() const { return s.size(); }
+  bool operator==(const char *c) const { return s == c; }
+};
+
+struct AsyncWebParameter {
+  String value() const { return String(); }
+};
+struct AsyncWebHeader {
+  String value() const { return String(); }
+};
+struct IPAddress {
+  operator uint32_t() const { return 0; }
+};
+struct AsyncClient {
+  IPAddress remoteIP() const { return {}; }
+};
+typedef std::function<size_t(uint8_t *, size_t, size_t)> AwsResponseFiller;
+struct AsyncWebServerResponse {
+  void addHeader(const String &, const String &) {}
+  void setCode(int) {}
+};
+struct AsyncResponseStream : AsyncWebServerResponse {
+  size_t print(const char *) { return 0; }
+  size_t printf(const char *, ...) { return 0; }
+  size_t write(const uint8_t *, size_t) { return 0; }
+  size_t write(uint8_t) { return 0; }
+};
+struct AsyncWebServerRequest {
+  bool authenticate(const char *, const char *) { return true; }
+  void requestAuthentication() {}
+  bool hasParam(const char *, bool = false, bool = false) const { return false; }
+  AsyncWebParameter *getParam(const char *, bool = false, bool = false) const { return nullptr; }
+  bool hasHeader(const char *) const { return false; }
+  AsyncWebHeader *getHeader(const char *) const { return nullptr; }
+  AsyncResponseStream *beginResponseStream(const char *) { return nullptr; }
+  AsyncWebServerResponse *beginResponse(int, const char * = "", const char * = "") { return nullptr; }
+  AsyncWebServerResponse *beginChunkedResponse(const char *, AwsResponseFiller) { return nullptr; }
+  void send(AsyncWebServerResponse *) {}
+  void send(int, const char * = "", const char * = "") {}
+  void redirect(const char *) {}
+  void onDisconnect(std::function<void()>) {}
+  AsyncClient *client() { return nullptr; }
+  String url() const { return String(); }
+};
+enum WebRequestMethod { HTTP_GET = 1, HTTP_POST = 2 };
+typedef std::function<void(AsyncWebServerRequest *)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *, const String &, size_t, uint8_t *, size_t, bool)>
+    ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *, uint8_t *, size_t, size_t, size_t)> ArBodyHandlerFunction;
+struct AsyncWebServer {
+  void on(const char *, int, ArRequestHandlerFunction, ArUploadHandlerFunction = nullptr,
+          ArBodyHandlerFunction = nullptr) {}
+};
+struct Application {
+  AsyncWebServer *get_web_server() { return nullptr; }
+};
+inline Application App;
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compila ed esegue su PC le prove (test_*.cpp) e i benchmark (bench_*.cpp)
+# del componente. Una riga "// Opzioni: ..." nel sorgente aggiunge opzioni
+# di compilazione per quella prova.
+#
+#   tests/run_tests.sh            tutte le prove e i benchmark
+#   tests/run_tests.sh journal    solo i file che contengono "journal"
+
+set -e
+cd "$(dirname "$0")"
+CXX=${CXX:-g++}
+OUT=${OUT:-/tmp/ble_key_manager_tests}
+mkdir -p "$OUT"
+
+failed=0
+for source in test_*.cpp bench_*.cpp; do
+  [ -e "$source" ] || continue
+  case "$source" in *"$1"*) ;; *) continue ;; esac
+  name=${source%.cpp}
+  options=$(sed -n 's|^// Opzioni: ||p' "$source")
+  echo "== $name"
+  if ! $CXX -std=c++17 -O2 -Wall -pthread -Ihost -I../components/ble_key_manager \
+      -o "$OUT/$name" "$source" $options; then
+    failed=1
+    continue
+  fi
+  if ! "$OUT/$name"; then
+    echo "$name: FALLITO"
+    failed=1
+  fi
+done
+exit $failed
@@ -0,0 +1,56 @@
+#pragma once
+
+// Flash simulata in memoria per le prove del giornale. Come la flash reale
+// può solo portare bit da 1 a 0; write_budget simula la caduta di corrente
+// (dopo quel numero di byte ogni scrittura e cancellazione fallisce, anche a
+// metà di un record) e fail_erase un settore che non si cancella più.
+
+#include "journal_store.h"
+#include <cstring>
+#include <vector>
+
+class SimFlash : public esphome::FlashDevice {
+ public:
+  SimFlash(size_t sector_size = 512, size_t sector_count = 8)
+      : sector_size_(sector_size), sector_count_(sector_count), memory_(sector_size * sector_count, 0xFF) {}
+
+  size_t sector_size() const override { return sector_size_; }
+  size_t sector_count() const override { return sector_count_; }
+
+  bool read(size_t address, void *data, size_t len) override {
+    if (address + len > memory_.size()) return false;
+    memcpy(data, &memory_[address], len);
+    return true;
+  }
+
+  bool write(size_t address, const void *data, size_t len) override {
+    if (address + len > memory_.size()) return false;
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < len; i++) {
+      if (write_budget == 0) return false;
+      if (write_budget > 0) write_budget--;
+      memory_[address + i] &= bytes[i];
+    }
+    writes++;
+    bytes_written += len;
+    return true;
+  }
+
+  bool erase_sector(size_t sector) override {
+    if (sector >= sector_count_ || write_budget == 0 || static_cast<long>(sector) == fail_erase) return false;
+    memset(&memory_[sector * sector_size_], 0xFF, sector_size_);
+    erases++;
+    return true;
+  }
+
+  long write_budget = -1;  // Byte ancora scrivibili (-1: nessun limite)
+  long fail_erase = -1;    // Settore che non si cancella (-1: nessuno)
+  uint32_t writes = 0;
+  uint32_t bytes_written = 0;
+  uint32_t erases = 0;
+
+ private:
+  size_t sector_size_;
+  size_t sector_count_;
+  std::vector<uint8_t> memory_;
+};
@@ -0,0 +1,49 @@
+// Gruppi di operazioni (/api/batch) e durata delle autorizzazioni
+
+#include "ble_device_manager.h"
+#include "check.h"
+
+using namespace esphome;
+
+static BatchReader read_batch(const std::string &text) {
+  BatchReader reader;
+  reader.feed(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+  reader.finish();
+  return reader;
+}
+
+int main() {
+  // Durate oltre i 10 anni, negative o fuori dai 32 bit vengono rifiutate
+  BatchReader reader = read_batch("authorize,AA:BB:CC:DD:EE:01,315360000\n"
+                                  "authorize,AA:BB:CC:DD:EE:01,315360001\n"
+                                  "authorize,AA:BB:CC:DD:EE:01,4294967295\n"
+                                  "authorize,AA:BB:CC:DD:EE:01,-1\n"
+                                  "authorize,AA:BB:CC:DD:EE:01,99999999999\n"
+                                  "authorize,AA:BB:CC:DD:EE:01\n");
+  const auto &ops = reader.operations();
+  CHECK(ops.size() == 6);
+  CHECK(ops[0].error == nullptr && ops[0].duration == REGISTRY_MAX_DURATION);
+  for (size_t i = 1; i < 5; i++) {
+    CHECK(ops[i].error != nullptr && strcmp(ops[i].error, "Durata non valida") == 0);
+  }
+  CHECK(ops[5].error == nullptr && ops[5].duration == 0);
+
+  // Anche authorize_device rifiuta le durate che farebbero traboccare la scadenza
+  fake_ms() = 4000000u * 1000u;
+  BLEDeviceManager manager;
+  CHECK(manager.add_device("AA:BB:CC:DD:EE:01", "Badge"));
+  CHECK(!manager.authorize_device("AA:BB:CC:DD:EE:01", 0xFFFFFFF0u));
+  CHECK(manager.authorize_device("AA:BB:CC:DD:EE:01", REGISTRY_MAX_DURATION));
+  CHECK(manager.is_device_authorized("AA:BB:CC:DD:EE:01"));
+  CHECK(manager.get_expires_in(*manager.get_device("AA:BB:CC:DD:EE:01")) == REGISTRY_MAX_DURATION);
+
+  // Un gruppo con una durata non valida non applica nulla
+  std::vector<const char *> errors;
+  BatchReader mixed = read_batch("add,AA:BB:CC:DD:EE:02,Nuovo\nauthorize,AA:BB:CC:DD:EE:02,400000000\n");
+  CHECK(!manager.apply_batch(mixed.operations(), &errors));
+  CHECK(errors[0] == nullptr && errors[1] != nullptr);
+  CHECK(manager.get_device("AA:BB:CC:DD:EE:02") == nullptr);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,115 @@
+// Accesso concorrente al registro: ciclo principale, scanner BLE e gestori
+// HTTP (task async_tcp) su thread diversi. Con -fsanitize=thread ogni accesso
+// non protetto dal mutex del registro viene segnalato come errore.
+// Opzioni: -fsanitize=thread -g
+
+#include "ble_device_manager.h"
+#include "check.h"
+#include "device_page_stream.h"
+#include "registry_export_stream.h"
+#include "sim_flash.h"
+#include <atomic>
+#include <thread>
+
+using namespace esphome;
+
+static const int DEVICES = 64;
+static const int ROUNDS = 2000;
+
+static std::string badge_mac(int i) {
+  char mac[18];
+  snprintf(mac, sizeof(mac), "AA:BB:CC:DD:EE:%02X", static_cast<unsigned>(i & 0xFF));
+  return mac;
+}
+
+template<typename Stream> static size_t drain(Stream *stream) {
+  uint8_t buffer[128];
+  size_t total = 0, len;
+  while ((len = stream->fill(buffer, sizeof(buffer))) > 0) {
+    total += len;
+  }
+  return total;
+}
+
+int main() {
+  fake_ms() = 1000000;
+  SimFlash flash(4096, 16);
+  BLEDeviceManager manager;
+  manager.set_flash_device(&flash);
+  manager.setup();
+  for (int i = 0; i < DEVICES / 2; i++) {
+    CHECK(manager.add_device(badge_mac(i), "Badge"));
+  }
+
+  std::atomic<bool> done{false};
+
+  // Ciclo principale
+  std::thread main_loop([&] {
+    while (!done) {
+      fake_ms() += 50;
+      manager.loop();
+    }
+  });
+
+  // Scanner BLE: solo la coda delle rilevazioni, senza mutex
+  std::thread scanner([&] {
+    uint32_t n = 0;
+    while (!done) {
+      n++;
+      manager.ingest_sighting(0xAABBCCDDEE00ULL + n % DEVICES, -40 - static_cast<int>(n % 50));
+      std::this_thread::yield();
+    }
+  });
+
+  // Gestori HTTP: modifiche, letture e risposte a blocchi
+  std::thread web([&] {
+    DeviceCardCache cache;
+    cache.set_capacity(4096);
+    for (int round = 0; round < ROUNDS; round++) {
+      std::string mac = badge_mac(round % DEVICES);
+      switch (round % 6) {
+        case 0: manager.add_device(mac, "Nuovo"); break;
+        case 1: manager.authorize_device(mac, 3600); break;
+        case 2: manager.revoke_authorization(mac); break;
+        case 3: manager.set_device_action(mac, round % 2 ? "apri" : "chiudi"); break;
+        case 4: manager.remove_device(mac); break;
+        case 5: {
+          std::vector<BatchOperation> operations(1);
+          operations[0].type = BatchOperation::AUTHORIZE;
+          operations[0].mac_address = mac;
+          std::vector<const char *> errors;
+          manager.apply_batch(operations, &errors);
+          break;
+        }
+      }
+      if (round % 50 == 0) {
+        DevicePageQuery query;
+        query.limit = 20;
+        DevicePageStream page(&manager, query, &cache);
+        drain(&page);
+        RegistryExportStream csv(&manager, false);
+        drain(&csv);
+      }
+      {
+        std::lock_guard<std::recursive_mutex> lock(manager.get_mutex());
+        for (const auto *device : manager.get_devices_changed_since(0)) {
+          CHECK(!device->mac_address.empty());
+          manager.get_expires_in(*device);
+        }
+        const RSSIHistory *history = manager.get_rssi_history(mac);
+        if (history != nullptr) {
+          history->sample_count();
+        }
+      }
+    }
+    done = true;
+  });
+
+  web.join();
+  scanner.join();
+  main_loop.join();
+  CHECK(manager.get_device_count() <= static_cast<size_t>(DEVICES));
+  CHECK(manager.get_ingest_applied() > 0);
+  printf("ok\n");
+  return 0;
+}
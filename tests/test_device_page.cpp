@@ -0,0 +1,44 @@
+// Pagina dei dispositivi: i campi inseriti dagli utenti vengono sempre
+// codificati, anche quando la scheda arriva dalla cache
+
+#include "device_page_stream.h"
+#include "check.h"
+
+using namespace esphome;
+
+static std::string render(BLEDeviceManager *manager, DeviceCardCache *cache) {
+  DevicePageQuery query;
+  query.limit = 50;
+  DevicePageStream stream(manager, query, cache);
+  std::string page;
+  uint8_t buffer[256];
+  size_t len;
+  while ((len = stream.fill(buffer, sizeof(buffer))) > 0) {
+    page.append(reinterpret_cast<char *>(buffer), len);
+  }
+  return page;
+}
+
+int main() {
+  fake_ms() = 1000000;
+  BLEDeviceManager manager;
+  CHECK(manager.add_device("AA:BB:CC:DD:EE:01", "<script>alert(1)</script>", "\"><img src=x onerror=alert(1)>"));
+  CHECK(manager.add_device("AA:BB:CC:DD:EE:02", "Ufficio 'A' & co", "toggle_relay"));
+  manager.update_device_seen("AA:BB:CC:DD:EE:01", -50);
+
+  DeviceCardCache cache;
+  cache.set_capacity(4096);
+  for (DeviceCardCache *c : {static_cast<DeviceCardCache *>(nullptr), &cache, &cache}) {
+    std::string page = render(&manager, c);
+    CHECK(page.find("<script>alert") == std::string::npos);
+    CHECK(page.find("<img") == std::string::npos);
+    CHECK(page.find("&lt;script&gt;alert(1)&lt;/script&gt;") != std::string::npos);
+    CHECK(page.find("&quot;&gt;&lt;img src=x onerror=alert(1)&gt;") != std::string::npos);
+    CHECK(page.find("Ufficio &#39;A&#39; &amp; co") != std::string::npos);
+    CHECK(page.find("/revoke?mac=AA%3ABB%3ACC%3ADD%3AEE%3A01'") != std::string::npos);
+  }
+  CHECK(cache.get_hits() > 0);
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,67 @@
+// Sincronizzazione incrementale del registro (/api/devices)
+
+#include "ble_device_manager.h"
+#include "check.h"
+#include <algorithm>
+
+using namespace esphome;
+
+static bool deleted_since(const BLEDeviceManager &manager, const std::string &mac, uint32_t since) {
+  for (const auto &deleted : manager.get_deleted_devices()) {
+    if (deleted.mac_address == mac && deleted.revision > since) return true;
+  }
+  return false;
+}
+
+static bool changed_since(const BLEDeviceManager &manager, const std::string &mac, uint32_t since) {
+  auto changed = manager.get_devices_changed_since(since);
+  return std::any_of(changed.begin(), changed.end(),
+                     [&](const BLEDeviceManager::BLEDevice *device) { return device->mac_address == mac; });
+}
+
+int main() {
+  fake_ms() = 1000000;
+  BLEDeviceManager manager;
+  CHECK(manager.add_device("AA:BB:CC:DD:EE:01", "Badge 1"));
+  CHECK(manager.add_device("AA:BB:CC:DD:EE:02", "Badge 2"));
+  uint32_t since = manager.get_revision();
+
+  // Eliminazione: riportata tra le eliminazioni
+  CHECK(manager.remove_device("AA:BB:CC:DD:EE:01"));
+  CHECK(deleted_since(manager, "AA:BB:CC:DD:EE:01", since));
+  CHECK(!changed_since(manager, "AA:BB:CC:DD:EE:01", since));
+  uint32_t after_delete = manager.get_revision();
+
+  // Eliminato e aggiunto di nuovo: solo tra i modificati, per qualsiasi since
+  CHECK(manager.add_device("aa-bb-cc-dd-ee-01", "Badge 1 bis"));
+  CHECK(changed_since(manager, "AA:BB:CC:DD:EE:01", since));
+  CHECK(!deleted_since(manager, "AA:BB:CC:DD:EE:01", since));
+  CHECK(changed_since(manager, "AA:BB:CC:DD:EE:01", after_delete));
+  CHECK(!deleted_since(manager, "AA:BB:CC:DD:EE:01", 0));
+  CHECK(manager.can_sync_since(manager.get_epoch(), since));
+  // Revisione di un avvio precedente: le eliminazioni di allora non sono più note
+  CHECK(!manager.can_sync_since(manager.get_epoch() + 1, since));
+
+  // Anche con l'importazione
+  CHECK(manager.remove_device("AA:BB:CC:DD:EE:02"));
+  RegistryRecord record;
+  parse_mac("AA:BB:CC:DD:EE:02", record.mac);
+  record.name = "Badge 2 bis";
+  record.expires_in = 3600;
+  manager.import_records({record});
+  CHECK(changed_since(manager, "AA:BB:CC:DD:EE:02", since));
+  CHECK(!deleted_since(manager, "AA:BB:CC:DD:EE:02", 0));
+
+  // Scadenza espressa in secondi mancanti, non nel tempo dall'avvio
+  const BLEDeviceManager::BLEDevice *device = manager.get_device("AA:BB:CC:DD:EE:02");
+  CHECK(device != nullptr);
+  CHECK(manager.get_expires_in(*device) == 3600);
+  fake_ms() += 600 * 1000;
+  CHECK(manager.get_expires_in(*device) == 3000);
+  CHECK(manager.get_expires_in(*manager.get_device("AA:BB:CC:DD:EE:01")) == REGISTRY_EXPIRES_NEVER);
+  CHECK(manager.revoke_authorization("AA:BB:CC:DD:EE:02"));
+  CHECK(manager.get_expires_in(*device) == REGISTRY_EXPIRES_REVOKED);
+
+  printf("ok\n");
+  return 0;
+}
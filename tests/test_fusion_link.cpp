@@ -0,0 +1,134 @@
+// Fusione tra nodi su UDP locale: indirizzi "ip:porta" e pacchetti accettati
+// solo dai nodi configurati, ognuno con un solo identificativo
+
+#include "ble_device_manager.h"
+#include "check.h"
+#include <unistd.h>
+
+using namespace esphome;
+
+static const uint16_t PORT_A = 47101;
+static const uint16_t PORT_B = 47102;
+static const uint16_t PORT_STRANGER = 47103;
+static const uint64_t BADGE = 0xAABBCC000001ULL;
+
+static std::string batch(uint32_t node_id, int8_t rssi) {
+  SightingBatchEncoder encoder;
+  Sighting sighting;
+  sighting.mac = BADGE;
+  sighting.rssi = rssi;
+  sighting.timestamp_ms = 5000;
+  CHECK(encoder.add(sighting));
+  return encoder.finish(node_id, 5000);
+}
+
+static void test_parse_peer() {
+  struct sockaddr_in address;
+  CHECK(FusionLink::parse_peer("192.168.1.51", 45678, &address));
+  CHECK(ntohs(address.sin_port) == 45678);
+  CHECK(FusionLink::parse_peer("192.168.1.51:5000", 45678, &address));
+  CHECK(ntohs(address.sin_port) == 5000);
+  CHECK(ntohl(address.sin_addr.s_addr) == 0xC0A80133);
+  const char *const invalid[] = {"", "nodo.local", "192.168.1.51:", "192.168.1.51:0", "192.168.1.51:65536",
+                                 "192.168.1.51:50a", "192.168.1.51:-1", "192.168.1:5000", ":5000"};
+  for (const char *peer : invalid) {
+    CHECK(!FusionLink::parse_peer(peer, 45678, &address));
+  }
+}
+
+static void test_link_sources() {
+  FusionLink a, b, stranger;
+  CHECK(a.open(PORT_A) && b.open(PORT_B) && stranger.open(PORT_STRANGER));
+  CHECK(a.add_peer("127.0.0.1:47102"));
+  CHECK(b.add_peer("127.0.0.1:47101"));
+  CHECK(stranger.add_peer("127.0.0.1:47101"));
+  CHECK(!a.add_peer("127.0.0.1:99999"));
+
+  stranger.send("da uno sconosciuto");
+  b.send("dal nodo b");
+  usleep(20000);
+  std::vector<std::string> received;
+  a.poll([&](const uint8_t *data, size_t len, size_t peer) {
+    CHECK(peer == 0);
+    received.emplace_back(reinterpret_cast<const char *>(data), len);
+  }, 8);
+  CHECK(received.size() == 1 && received[0] == "dal nodo b");
+  CHECK(a.get_packets_received() == 1);
+  CHECK(a.get_unknown_sources() == 1);
+}
+
+static void test_manager_peers() {
+  fake_ms() = 1000000;
+  BLEDeviceManager manager;
+  manager.set_fusion_node_id(1);
+  manager.set_fusion_port(PORT_A);
+  manager.add_fusion_peer("127.0.0.1:47102");
+  manager.setup();
+  CHECK(manager.get_fusion_link() != nullptr);
+  CHECK(manager.add_device("AA:BB:CC:00:00:01", "Badge"));
+  CHECK(manager.ingest_sighting(BADGE, -80));
+  manager.loop();
+
+  FusionLink b, stranger;
+  CHECK(b.open(PORT_B) && stranger.open(PORT_STRANGER));
+  CHECK(b.add_peer("127.0.0.1:47101"));
+  CHECK(stranger.add_peer("127.0.0.1:47101"));
+
+  // Un mittente non configurato non entra nella fusione, con nessun identificativo
+  for (uint32_t node = 2; node < 20; node++) {
+    stranger.send(batch(node, -30));
+  }
+  usleep(20000);
+  for (int i = 0; i < 10; i++) manager.loop();
+  FusedEstimate estimate;
+  CHECK(manager.get_fused_estimate("AA:BB:CC:00:00:01", &estimate));
+  CHECK(estimate.nodes == 1 && estimate.nearest_node == 1);
+  CHECK(manager.get_fusion_link()->get_unknown_sources() == 18);
+
+  // Il nodo configurato viene accettato con il primo identificativo usato
+  b.send(batch(2, -50));
+  usleep(20000);
+  manager.loop();
+  CHECK(manager.get_fused_estimate("AA:BB:CC:00:00:01", &estimate));
+  CHECK(estimate.nodes == 2 && estimate.nearest_node == 2);
+  CHECK(manager.get_closest_authorized_device() == nullptr);
+
+  // ...e non può occupare altri posti cambiando identificativo
+  uint32_t rejected = manager.get_fusion_rejected_packets();
+  for (uint32_t node = 3; node < 12; node++) {
+    b.send(batch(node, -40));
+  }
+  usleep(20000);
+  for (int i = 0; i < 10; i++) manager.loop();
+  CHECK(manager.get_fusion_rejected_packets() == rejected + 9);
+  CHECK(manager.get_fused_estimate("AA:BB:CC:00:00:01", &estimate));
+  CHECK(estimate.nodes == 2);
+
+  // Telefoni con MAC casuali, visti qui e dal nodo b: non entrano nella
+  // fusione e la traccia del badge resta
+  SightingBatchEncoder phones;
+  for (uint64_t phone = 0; phone < 200; phone++) {
+    CHECK(manager.ingest_sighting(0x7A0000000000ULL + phone, -40));
+    if (phone % 32 == 31) manager.loop();
+    Sighting sighting;
+    sighting.mac = 0x7B0000000000ULL + phone;
+    sighting.rssi = -40;
+    sighting.timestamp_ms = 5000;
+    if (phone < 20) phones.add(sighting);
+  }
+  b.send(phones.finish(2, 5000));
+  usleep(20000);
+  manager.loop();
+  CHECK(manager.get_fusion_foreign_sightings() == 20);
+  CHECK(manager.get_fused_estimate("AA:BB:CC:00:00:01", &estimate));
+  CHECK(estimate.nodes == 2 && estimate.nearest_node == 2);
+  CHECK(!manager.get_fused_estimate("7A:00:00:00:00:05", &estimate));
+}
+
+int main() {
+  test_parse_peer();
+  test_link_sources();
+  test_manager_peers();
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,351 @@
+// Giornale su flash: scadenze attraverso i riavvii, interruzioni di corrente,
+// gruppi di modifiche interrotti, partizione piena e guasti della flash
+
+#include "ble_device_manager.h"
+#include "check.h"
+#include "sim_flash.h"
+
+using namespace esphome;
+
+static const char *const BADGE = "AA:BB:CC:DD:EE:01";
+
+static std::string badge_mac(int i) {
+  char mac[18];
+  snprintf(mac, sizeof(mac), "AA:BB:CC:DD:EE:%02X", static_cast<unsigned>(i & 0xFF));
+  return mac;
+}
+
+// Avvio del dispositivo: millis() riparte da pochi secondi
+static void boot(BLEDeviceManager *manager, SimFlash *flash) {
+  fake_ms() = 2000;
+  manager->set_flash_device(flash);
+  manager->setup();
+}
+
+// Funzionamento per seconds secondi, con un ciclo ogni 10 secondi
+static void run_for(BLEDeviceManager *manager, uint32_t seconds) {
+  for (uint32_t elapsed = 0; elapsed < seconds; elapsed += 10) {
+    fake_ms() += 10 * 1000;
+    manager->loop();
+  }
+}
+
+static uint32_t expires_in(BLEDeviceManager &manager, const std::string &mac) {
+  const BLEDeviceManager::BLEDevice *device = manager.get_device(mac);
+  CHECK(device != nullptr);
+  return manager.get_expires_in(*device);
+}
+
+static void test_expiry_across_reboots() {
+  SimFlash flash;
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.add_device(BADGE, "Badge"));
+    CHECK(manager.authorize_device(BADGE, 86400));
+    run_for(&manager, 80000);
+    CHECK(expires_in(manager, BADGE) == 6400);
+  }
+  // Dopo il riavvio restano i secondi mancanti, non le 24 ore iniziali
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    uint32_t remaining = expires_in(manager, BADGE);
+    CHECK(remaining >= 6400 && remaining <= 6400 + BLEDeviceManager::CLOCK_CHECKPOINT_INTERVAL);
+    CHECK(manager.is_device_authorized(BADGE));
+  }
+  // Riavvii ripetuti: ogni periodo di funzionamento viene scalato
+  for (int cycle = 0; cycle < 10; cycle++) {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    run_for(&manager, 600);
+  }
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    uint32_t remaining = expires_in(manager, BADGE);
+    CHECK(remaining <= 400 + BLEDeviceManager::CLOCK_CHECKPOINT_INTERVAL);
+    run_for(&manager, 600);
+    CHECK(!manager.is_device_authorized(BADGE));
+  }
+  // Revocata prima del riavvio resta revocata; una breve continua a scalare
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(!manager.is_device_authorized(BADGE));
+    CHECK(manager.authorize_device(BADGE, 100));
+    run_for(&manager, 90);
+  }
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.is_device_authorized(BADGE));
+    CHECK(expires_in(manager, BADGE) <= 10 + BLEDeviceManager::CLOCK_CHECKPOINT_INTERVAL);
+    run_for(&manager, 10 + BLEDeviceManager::CLOCK_CHECKPOINT_INTERVAL);
+    CHECK(!manager.is_device_authorized(BADGE));
+  }
+  // Permanenti e revocate non dipendono dall'orologio
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.add_device(badge_mac(2), "Permanente"));
+    CHECK(manager.authorize_device(badge_mac(2)));
+    run_for(&manager, 1000);
+  }
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(expires_in(manager, badge_mac(2)) == REGISTRY_EXPIRES_NEVER);
+    CHECK(expires_in(manager, BADGE) == REGISTRY_EXPIRES_REVOKED);
+  }
+}
+
+static void test_power_cuts() {
+  SimFlash flash(512, 16);
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    for (int i = 0; i < 40; i++) {
+      CHECK(manager.add_device(badge_mac(i), "Badge"));
+      manager.loop();
+    }
+    for (int round = 0; round < 200; round++) {
+      std::string mac = badge_mac(round % 40);
+      manager.authorize_device(mac, round % 3 ? 0 : 100000);
+      if (round % 7 == 0) manager.revoke_authorization(mac);
+      manager.loop();
+      manager.loop();
+    }
+    CHECK(manager.remove_device(badge_mac(5)));
+    std::vector<BatchOperation> operations(2);
+    operations[0].type = BatchOperation::ADD;
+    operations[0].mac_address = "11:22:33:44:55:66";
+    operations[0].name = "Nuovo";
+    operations[1].type = BatchOperation::REVOKE;
+    operations[1].mac_address = badge_mac(1);
+    std::vector<const char *> errors;
+    CHECK(manager.apply_batch(operations, &errors));
+    flash.write_budget = 0;  // Corrente tolta
+  }
+  flash.write_budget = -1;
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.get_device_count() == 40);
+    CHECK(manager.get_device(badge_mac(5)) == nullptr);
+    CHECK(!manager.is_device_authorized(badge_mac(1)));
+    CHECK(manager.get_device("11:22:33:44:55:66") != nullptr);
+
+    // Gruppo interrotto a metà del secondo record: non deve restare nulla
+    std::vector<BatchOperation> operations(2);
+    operations[0].type = BatchOperation::ADD;
+    operations[0].mac_address = "77:22:33:44:55:66";
+    operations[0].name = "Interrotto";
+    operations[1].type = BatchOperation::REMOVE;
+    operations[1].mac_address = badge_mac(2);
+    flash.write_budget = 8 + 24 + 3;
+    std::vector<const char *> errors;
+    manager.apply_batch(operations, &errors);
+  }
+  flash.write_budget = -1;
+  // Molte scritture e compattazioni, poi taglio in un punto qualsiasi
+  srand(1);
+  for (int cycle = 0; cycle < 30; cycle++) {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.get_device("77:22:33:44:55:66") == nullptr);
+    CHECK(manager.get_device(badge_mac(2)) != nullptr);
+    CHECK(manager.get_device_count() == 40);
+    flash.write_budget = rand() % 3000 + 100;
+    for (int round = 0; round < 300; round++) {
+      manager.set_device_action(badge_mac(round % 40), round % 2 ? "a" : "bb");
+      manager.loop();
+    }
+    flash.write_budget = -1;
+  }
+}
+
+// Partizione piccola: i nuovi dispositivi vengono rifiutati prima che lo
+// snapshot non ci stia più, e le modifiche continuano a essere salvate
+static void test_full_journal() {
+  SimFlash flash(512, 8);
+  int added = 0;
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    while (manager.add_device(badge_mac(added), "Badge con un nome lungo")) {
+      added++;
+      manager.loop();
+    }
+    CHECK(added > 0 && added < 100);
+
+    std::vector<BatchOperation> operations(1);
+    operations[0].type = BatchOperation::ADD;
+    operations[0].mac_address = badge_mac(added);
+    operations[0].name = "Badge con un nome lungo";
+    std::vector<const char *> errors;
+    CHECK(!manager.apply_batch(operations, &errors));
+    CHECK(errors[0] != nullptr);
+
+    // Le chiavi occupano spazio come i dispositivi: un gruppo che non ci sta
+    // viene rifiutato per intero
+    operations.assign(added + 1, BatchOperation());
+    operations[0].type = BatchOperation::ADD;
+    operations[0].mac_address = badge_mac(0);
+    operations[0].name = "Badge con un nome lungo";
+    for (int i = 0; i < added; i++) {
+      operations[i + 1].type = BatchOperation::SET_KEY;
+      operations[i + 1].mac_address = badge_mac(i);
+      operations[i + 1].key = std::string(ROLLING_KEY_SIZE, 'k');
+    }
+    CHECK(!manager.apply_batch(operations, &errors));
+    CHECK(errors[0] == nullptr);
+    CHECK(strcmp(errors[added], "Memoria di salvataggio piena") == 0);
+    for (int i = 0; i < added; i++) {
+      CHECK(manager.get_device(badge_mac(i))->rolling_key.empty());
+    }
+    int keyed = 0;
+    while (keyed < added && manager.set_device_key(badge_mac(keyed), std::string(ROLLING_KEY_SIZE, 'k'))) {
+      keyed++;
+    }
+    CHECK(keyed < added);
+    CHECK(!manager.add_device(badge_mac(added - 1), std::string(REGISTRY_MAX_NAME_LENGTH, 'n')));
+    CHECK(manager.get_device(badge_mac(added - 1))->name == "Badge con un nome lungo");
+
+    for (int round = 0; round < 5000; round++) {
+      manager.set_device_action(badge_mac(round % added), round % 2 ? "apri" : "chiudi");
+      if (round % 3 == 0) manager.authorize_device(badge_mac(round % added), 1000 + round);
+      manager.loop();
+    }
+    for (int i = 0; i < added; i++) {
+      manager.set_device_action(badge_mac(i), "finale");
+    }
+    CHECK(manager.get_journal()->get_write_errors() == 0);
+    CHECK(manager.get_journal_dropped() == 0);
+    CHECK(!manager.status_has_warning());
+  }
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.get_device_count() == static_cast<size_t>(added));
+    for (int i = 0; i < added; i++) {
+      CHECK(manager.get_device(badge_mac(i))->action_id == "finale");
+    }
+  }
+}
+
+// Gruppo annullato: le sue modifiche vengono scartate all'avvio, quelle
+// successive restano
+static void test_aborted_group() {
+  SimFlash flash;
+  RegistryRecord record;
+  parse_mac(BADGE, record.mac);
+  record.name = "Annullato";
+  record.expires_in = REGISTRY_EXPIRES_NEVER;
+  {
+    JournalStore journal(&flash);
+    CHECK(journal.load([](const JournalEntry &) {}));
+    CHECK(journal.begin_transaction());
+    CHECK(journal.append_put(record));
+    CHECK(journal.abort_transaction());
+    record.name = "Salvato";
+    parse_mac(badge_mac(2), record.mac);
+    CHECK(journal.append_put(record));
+  }
+  std::vector<std::string> names;
+  JournalStore journal(&flash);
+  CHECK(journal.load([&names](const JournalEntry &entry) {
+    if (entry.type == JOURNAL_PUT) names.push_back(entry.record.name);
+  }));
+  CHECK(names.size() == 1 && names[0] == "Salvato");
+
+  // Un'operazione che non riesce durante l'applicazione annulla anche le
+  // precedenti, in memoria e dopo il riavvio
+  SimFlash registry;
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &registry);
+    CHECK(manager.add_device(BADGE, "Badge", "apri"));
+    std::vector<BatchOperation> operations(4);
+    operations[0].type = BatchOperation::ADD;
+    operations[0].mac_address = badge_mac(2);
+    operations[0].name = "Nuovo";
+    operations[1].type = BatchOperation::SET_ACTION;
+    operations[1].mac_address = BADGE;
+    operations[1].action_id = "chiudi";
+    operations[2].type = BatchOperation::REMOVE;
+    operations[2].mac_address = BADGE;
+    operations[3].type = BatchOperation::ADD;
+    operations[3].mac_address = badge_mac(3);  // Nome vuoto: add_device fallisce
+    std::vector<const char *> errors;
+    CHECK(!manager.apply_batch(operations, &errors));
+    CHECK(errors[3] != nullptr);
+    CHECK(manager.get_device_count() == 1);
+    CHECK(manager.get_authorized_count() == 1);
+    CHECK(manager.get_device(BADGE)->action_id == "apri");
+    CHECK(manager.get_device(badge_mac(2)) == nullptr);
+    CHECK(manager.add_device(badge_mac(4), "Dopo"));
+  }
+  BLEDeviceManager manager;
+  boot(&manager, &registry);
+  CHECK(manager.get_device_count() == 2);
+  CHECK(manager.get_device(BADGE)->action_id == "apri");
+  CHECK(manager.get_device(badge_mac(4)) != nullptr);
+}
+
+// Guasti iniettati: un settore che non si cancella e scritture che
+// falliscono. Le modifiche perse vengono contate e segnalate, il giornale
+// riprende appena la flash torna a funzionare.
+static void test_flash_faults() {
+  SimFlash flash(512, 16);
+  flash.fail_erase = 3;
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    for (int i = 0; i < 30; i++) {
+      CHECK(manager.add_device(badge_mac(i), "Badge"));
+    }
+    for (int round = 0; round < 2000; round++) {
+      manager.set_device_action(badge_mac(round % 30), round % 2 ? "a" : "b");
+      manager.loop();
+    }
+    CHECK(manager.get_journal_dropped() == 0);
+
+    flash.write_budget = 0;
+    CHECK(manager.set_device_action(badge_mac(0), "persa"));
+    CHECK(manager.get_journal_dropped() == 1);
+    CHECK(manager.status_has_warning());
+
+    flash.write_budget = -1;
+    for (int i = 0; i < 30; i++) {
+      CHECK(manager.set_device_action(badge_mac(i), "salvata"));
+      manager.loop();
+    }
+    CHECK(!manager.status_has_warning());
+  }
+  {
+    BLEDeviceManager manager;
+    boot(&manager, &flash);
+    CHECK(manager.get_device_count() == 30);
+    for (int i = 0; i < 30; i++) {
+      CHECK(manager.get_device(badge_mac(i))->action_id == "salvata");
+    }
+  }
+  // Partizione mancante: avviso, registro solo in memoria
+  {
+    BLEDeviceManager manager;
+    manager.setup();
+    CHECK(manager.status_has_warning());
+    CHECK(manager.add_device(badge_mac(1), "Badge"));
+  }
+}
+
+int main() {
+  test_expiry_across_reboots();
+  test_power_cuts();
+  test_full_journal();
+  test_aborted_group();
+  test_flash_faults();
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,74 @@
+// Importazione del registro (/api/import) e formati dei MAC accettati
+
+#include "ble_device_manager.h"
+#include "check.h"
+
+using namespace esphome;
+
+static RegistryImporter import_csv(const std::string &csv) {
+  RegistryImporter importer(false);
+  importer.feed(reinterpret_cast<const uint8_t *>(csv.data()), csv.size());
+  importer.finish();
+  return importer;
+}
+
+static std::string badges_csv(size_t first, size_t count) {
+  std::string csv = "mac,name,action,expires_in\n";
+  char line[64];
+  for (size_t i = first; i < first + count; i++) {
+    snprintf(line, sizeof(line), "AA:BB:CC:DD:%02X:%02X,Badge %u,,0\n", (unsigned) (i >> 8), (unsigned) (i & 0xFF),
+             (unsigned) i);
+    csv += line;
+  }
+  return csv;
+}
+
+int main() {
+  // Scadenze: solo interi decimali senza segno a 32 bit
+  const char *invalid[] = {"-1", "+5", " 5", "4294967296", "99999999999999999999", "12x", "0x10"};
+  for (const char *value : invalid) {
+    RegistryImporter importer = import_csv(std::string("AA:BB:CC:DD:EE:01,Badge,,") + value + "\n");
+    CHECK(importer.error_count() == 1);
+    CHECK(importer.records().empty());
+    CHECK(strcmp(importer.errors()[0].message, "Scadenza non valida") == 0);
+  }
+  RegistryImporter valid = import_csv("AA:BB:CC:DD:EE:01,Badge,,315360000\nAA:BB:CC:DD:EE:02,Badge,,3600\n");
+  CHECK(valid.error_count() == 0);
+  CHECK(valid.records().size() == 2 && valid.records()[1].expires_in == 3600);
+
+  // I record oltre la capienza del registro non vengono conservati
+  RegistryImporter big = import_csv(badges_csv(0, REGISTRY_MAX_DEVICES + 50));
+  CHECK(big.records().size() == REGISTRY_MAX_DEVICES);
+  CHECK(big.error_count() == 50);
+  CHECK(strcmp(big.errors()[0].message, "Troppi dispositivi") == 0);
+
+  // La capienza vale anche per il registro già esistente
+  fake_ms() = 1000000;
+  BLEDeviceManager manager;
+  CHECK(manager.import_records(import_csv(badges_csv(0, REGISTRY_MAX_DEVICES - 10)).records()));
+  CHECK(manager.get_device_count() == REGISTRY_MAX_DEVICES - 10);
+  CHECK(!manager.import_records(import_csv(badges_csv(REGISTRY_MAX_DEVICES - 20, 30)).records()));
+  CHECK(manager.get_device_count() == REGISTRY_MAX_DEVICES - 10);
+  CHECK(manager.import_records(import_csv(badges_csv(REGISTRY_MAX_DEVICES - 15, 15)).records()));
+  CHECK(manager.get_device_count() == REGISTRY_MAX_DEVICES);
+  CHECK(!manager.add_device("11:22:33:44:55:66", "Di troppo"));
+  CHECK(manager.add_device("AA:BB:CC:DD:00:00", "Esistente"));
+
+  // Tutte le funzioni accettano il MAC in qualsiasi formato valido
+  CHECK(manager.remove_device("aa-bb-cc-dd-00-01"));
+  CHECK(manager.get_device("AA:BB:CC:DD:00:01") == nullptr);
+  CHECK(manager.revoke_authorization("aa:bb:cc:dd:00:02"));
+  CHECK(!manager.is_device_authorized("AA-BB-CC-DD-00-02"));
+  CHECK(manager.authorize_device("aa-bb-cc-dd-00-02", 60));
+  CHECK(manager.is_device_authorized("aa:bb:cc:dd:00:02"));
+  CHECK(manager.set_device_action("aa:bb:cc:dd:00:03", "toggle_relay"));
+  CHECK(manager.get_device("AA:BB:CC:DD:00:03")->action_id == "toggle_relay");
+  manager.update_device_seen("aa:bb:cc:dd:00:03", -42);
+  CHECK(manager.get_rssi_history("aa-bb-cc-dd-00-03") != nullptr);
+  CHECK(manager.get_rssi_history("AA:BB:CC:DD:00:03") != nullptr);
+  CHECK(manager.get_device("non un MAC") == nullptr);
+  CHECK(!manager.remove_device("AA:BB:CC:DD:00"));
+
+  printf("ok\n");
+  return 0;
+}
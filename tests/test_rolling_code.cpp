@@ -0,0 +1,190 @@
+// Token a codice variabile: vettori di prova della firma (calcolati con
+// HMAC-SHA256 di riferimento), finestra del contatore, token ripetuti e
+// contatore seguito alla ricezione
+
+#include "ble_device_manager.h"
+#include "check.h"
+#include "sim_flash.h"
+
+using namespace esphome;
+
+static const uint8_t KEY[ROLLING_KEY_SIZE] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+static const uint8_t MAC[6] = {0xAA, 0xBB, 0xCC, 0x00, 0x00, 0x01};
+static const char *const MAC_TEXT = "AA:BB:CC:00:00:01";
+
+static std::string hex(const uint8_t *data, size_t len) {
+  std::string out;
+  char byte[3];
+  for (size_t i = 0; i < len; i++) {
+    snprintf(byte, sizeof(byte), "%02x", data[i]);
+    out += byte;
+  }
+  return out;
+}
+
+static RollingToken make_token(uint32_t counter) {
+  RollingToken token;
+  token.counter = counter;
+  compute_rolling_tag(KEY, sizeof(KEY), MAC, counter, token.tag);
+  return token;
+}
+
+// Dati del produttore come li trasmette il badge
+static std::vector<uint8_t> advertisement(const RollingToken &token) {
+  std::vector<uint8_t> data(ROLLING_TOKEN_SIZE);
+  data[0] = ROLLING_TOKEN_VERSION;
+  for (int i = 0; i < 4; i++) data[1 + i] = token.counter >> (8 * i);
+  memcpy(&data[5], token.tag, ROLLING_TAG_SIZE);
+  return data;
+}
+
+static std::vector<uint8_t> advertisement(uint32_t counter) {
+  return advertisement(make_token(counter));
+}
+
+static void test_vectors() {
+  const struct {
+    uint32_t counter;
+    const char *tag;
+  } vectors[] = {
+      {1, "090ebf489bf42dcc"},
+      {2, "8bf911dd6f8c136b"},
+      {1000, "8b440d39634bb81d"},
+      {1025, "44b5cc0542b757f2"},
+      {4294967295u, "a78e677f8b8ce04d"},
+  };
+  for (const auto &vector : vectors) {
+    RollingToken token = make_token(vector.counter);
+    CHECK(hex(token.tag, ROLLING_TAG_SIZE) == vector.tag);
+    std::vector<uint8_t> data = advertisement(vector.counter);
+    RollingToken parsed;
+    CHECK(parse_rolling_token(data.data(), data.size(), &parsed));
+    CHECK(parsed.counter == vector.counter && memcmp(parsed.tag, token.tag, ROLLING_TAG_SIZE) == 0);
+  }
+  std::vector<uint8_t> data = advertisement(1);
+  RollingToken parsed;
+  CHECK(!parse_rolling_token(data.data(), data.size() - 1, &parsed));
+  data[0] = 2;
+  CHECK(!parse_rolling_token(data.data(), data.size(), &parsed));
+}
+
+static void test_window() {
+  RollingCodeVerifier verifier;
+  uint32_t last = 0;
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, make_token(1), &last) == ROLLING_OK && last == 1);
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, make_token(1), &last) == ROLLING_REPLAYED);
+
+  // Confine della finestra: last + WINDOW sì, last + WINDOW + 1 no
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, make_token(1 + ROLLING_COUNTER_WINDOW + 1), &last) ==
+        ROLLING_OUT_OF_WINDOW);
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, make_token(4294967295u), &last) == ROLLING_OUT_OF_WINDOW);
+  CHECK(last == 1);
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, make_token(1 + ROLLING_COUNTER_WINDOW), &last) == ROLLING_OK);
+  CHECK(last == 1 + ROLLING_COUNTER_WINDOW);
+
+  // Firma errata, poi lo stesso token falso viene scartato dalla cache
+  RollingToken forged = make_token(last + 1);
+  forged.tag[0] ^= 1;
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, forged, &last) == ROLLING_BAD_TAG);
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, forged, &last) == ROLLING_REPLAYED);
+  CHECK(verifier.get_rejected_tag() == 1 && verifier.get_rejected_window() == 2);
+  CHECK(verifier.get_accepted() == 2);
+
+  // Contatore seguito senza consumare il token
+  last = 10;
+  CHECK(verifier.track(KEY, sizeof(KEY), MAC, make_token(11), &last, true) && last == 10);
+  CHECK(verifier.track(KEY, sizeof(KEY), MAC, make_token(50), &last, true) && last == 49);
+  CHECK(!verifier.track(KEY, sizeof(KEY), MAC, make_token(49), &last, true) && last == 49);
+  CHECK(!verifier.track(KEY, sizeof(KEY), MAC, make_token(50 + ROLLING_COUNTER_WINDOW), &last, true));
+  CHECK(!verifier.track(KEY, sizeof(KEY), MAC, forged, &last, false) && last == 49);
+  CHECK(verifier.track(KEY, sizeof(KEY), MAC, make_token(50 + ROLLING_COUNTER_WINDOW), &last, false));
+  CHECK(verifier.verify(KEY, sizeof(KEY), MAC, make_token(50 + ROLLING_COUNTER_WINDOW), &last) == ROLLING_OK);
+}
+
+// Annuncio ricevuto 11 secondi dopo il precedente
+static void receive(BLEDeviceManager *manager, const RollingToken &token) {
+  std::vector<uint8_t> data = advertisement(token);
+  fake_ms() += 11000;
+  CHECK(manager->ingest_sighting(mac_to_u64(MAC), -60, data.data(), data.size()));
+  manager->loop();
+}
+
+static void receive(BLEDeviceManager *manager, uint32_t counter) {
+  receive(manager, make_token(counter));
+}
+
+static void test_manager() {
+  fake_ms() = 1000000;
+  SimFlash flash(512, 16);
+  {
+    BLEDeviceManager manager;
+    manager.set_flash_device(&flash);
+    manager.setup();
+    CHECK(manager.add_device(MAC_TEXT, "Badge"));
+    CHECK(manager.set_device_key(MAC_TEXT, std::string(reinterpret_cast<const char *>(KEY), sizeof(KEY))));
+    CHECK(manager.ingest_sighting(mac_to_u64(MAC), -60));
+    manager.loop();
+    CHECK(manager.get_closest_authorized_device() == nullptr);  // Senza token
+
+    // Il primo token dopo il cambio di chiave allinea il contatore e viene consumato
+    receive(&manager, 4);
+    CHECK(manager.get_closest_authorized_device() == nullptr);
+    receive(&manager, 5);
+    CHECK(manager.get_closest_authorized_device() != nullptr);
+    CHECK(manager.get_closest_authorized_device() == nullptr);  // Già consumato
+
+    // Un token intercettato e non usato smette di valere appena il badge
+    // ne trasmette uno più recente, anche senza decisioni
+    RollingToken sniffed = make_token(6);
+    receive(&manager, 7);
+    receive(&manager, sniffed);
+    CHECK(manager.get_closest_authorized_device() != nullptr);
+    CHECK(manager.get_device(MAC_TEXT)->rolling_counter == 7);
+
+    // L'ultimo token trasmesso prima di allontanarsi, ripetuto più tardi con
+    // il MAC del badge, non viene rinnovato (nemmeno dopo un token falso) e
+    // scade con la sua prima ricezione
+    receive(&manager, 9);
+    fake_ms() += 50000;
+    RollingToken forged = make_token(10);
+    forged.tag[0] ^= 1;
+    receive(&manager, forged);
+    receive(&manager, make_token(9));
+    CHECK(manager.get_closest_authorized_device() == nullptr);
+    CHECK(manager.get_device(MAC_TEXT)->rolling_counter == 8);
+  }
+  // Dopo il riavvio: il contatore seguito alla ricezione è stato salvato, e
+  // il token 9 non torna a valere
+  {
+    BLEDeviceManager manager;
+    manager.set_flash_device(&flash);
+    manager.setup();
+    CHECK(manager.get_device(MAC_TEXT)->rolling_counter == 8);
+    receive(&manager, make_token(9));
+    CHECK(manager.get_closest_authorized_device() == nullptr);
+  }
+  // Un badge che nel frattempo ha emesso molti token viene riallineato alla
+  // prima ricezione, che consuma il token: vale il successivo
+  {
+    BLEDeviceManager manager;
+    manager.set_flash_device(&flash);
+    manager.setup();
+    uint32_t far = 9 + 5 * ROLLING_COUNTER_WINDOW;
+    receive(&manager, far);
+    CHECK(manager.get_closest_authorized_device() == nullptr);
+    receive(&manager, far + 1);
+    CHECK(manager.get_closest_authorized_device() != nullptr);
+    // Una volta riallineato il salto oltre la finestra non è più accettato
+    receive(&manager, far + 2 * ROLLING_COUNTER_WINDOW);
+    CHECK(manager.get_closest_authorized_device() == nullptr);
+    CHECK(manager.get_rolling_verifier().get_rejected_window() >= 1);
+  }
+}
+
+int main() {
+  test_vectors();
+  test_window();
+  test_manager();
+  printf("ok\n");
+  return 0;
+}